@@ -5,143 +5,2501 @@
 /// @date 2025-4-7
 
 #include "thermometer.h"
+#ifdef THERMOMETER_USE_LUT
+#include "thermometer_lut.h"
+#endif
+#ifdef THERMOMETER_USE_PROFILE
+#include "thermometer_profile.h"
+#else
+#define THERMOMETER_PROFILE_CALIBRATION \
+    {                                   \
+        .time_divisor = 50000,          \
+        .resistance_offset = 8000,      \
+        .slope = -18,                   \
+        .intercept = 55685,             \
+        .scale = 463,                   \
+    }
+#endif
 
+#include <linux/cpufreq.h>
 #include <linux/delay.h>
 #include <linux/fs.h> // file_operations
 #include <linux/gpio.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
+#include <linux/int_sqrt.h>
+#include <linux/interrupt.h>
+#include <linux/io.h>
 #include <linux/module.h>
 #include <linux/printk.h>
+#include <linux/ratelimit.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sort.h>
+#include <linux/sysfs.h>
+#include <linux/cred.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
 #include <linux/types.h>
 #include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+int thermometer_major = 0; // use dynamic major
+int thermometer_minor = 0;
+
+#define GPIO_OFFSET 512U
+#define INPUT_BCM_PIN 18U
+#define OUTPUT_BCM_PIN 23U
+#define INPUT_PIN (GPIO_OFFSET + INPUT_BCM_PIN)  // GPIO 18
+#define OUTPUT_PIN (GPIO_OFFSET + OUTPUT_BCM_PIN) // GPIO 23
+#define TEMPERATURE_LENGTH 30U
+#define THERMOMETER_DISCHARGE_MS 5U
+#define THERMOMETER_MINOR_COUNT 4U
+
+#ifdef __KERNEL__
+MODULE_AUTHOR("Sean Sweet");
+MODULE_LICENSE("Dual BSD/GPL");
+#endif
+
+#ifdef CONFIG_THERMOMETER_RING
+static unsigned int ring_pages = 4;
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "Number of data pages in the mmap-able sample ring (rounded up to a power of 2)");
+#endif
+
+#ifdef CONFIG_THERMOMETER_RATE_LIMIT
+static unsigned int rate_limit = 0;
+module_param(rate_limit, uint, 0644);
+MODULE_PARM_DESC(rate_limit, "Hardware measurements per second across all users, 0 for unlimited");
+
+static unsigned int rate_burst = 4;
+module_param(rate_burst, uint, 0644);
+MODULE_PARM_DESC(rate_burst, "Measurements that can be taken back to back under rate_limit");
+
+static unsigned int uid_rate_limit = 0;
+module_param(uid_rate_limit, uint, 0644);
+MODULE_PARM_DESC(uid_rate_limit, "Hardware measurements per second for each user, 0 for unlimited");
+
+static unsigned int uid_rate_burst = 2;
+module_param(uid_rate_burst, uint, 0644);
+MODULE_PARM_DESC(uid_rate_burst, "Measurements that can be taken back to back under uid_rate_limit");
+#endif
+
+#ifdef CONFIG_THERMOMETER_SAMPLER
+static unsigned int sample_mode = THERMOMETER_MODE_OPEN;
+module_param(sample_mode, uint, 0444);
+MODULE_PARM_DESC(sample_mode, "0: measure on open, 1: periodic, 2: aligned to wall clock, 3: external GPIO trigger");
+
+static unsigned int sample_interval_ms = 1000;
+module_param(sample_interval_ms, uint, 0444);
+MODULE_PARM_DESC(sample_interval_ms, "Sampler interval for the periodic and aligned modes");
+
+static int trigger_gpio = -1;
+module_param(trigger_gpio, int, 0444);
+MODULE_PARM_DESC(trigger_gpio, "BCM GPIO number whose rising edge triggers a sample in the external mode");
+
+static unsigned int watchdog_intervals = 5;
+module_param(watchdog_intervals, uint, 0644);
+MODULE_PARM_DESC(watchdog_intervals, "Sample intervals without a sample after which the sampler is restarted, 0 to disable, unused in the external mode");
+#endif
+
+#ifdef CONFIG_THERMOMETER_BUDGET
+static unsigned int cpu_budget_ppm = 0;
+module_param(cpu_budget_ppm, uint, 0644);
+MODULE_PARM_DESC(cpu_budget_ppm, "Share of CPU time measurements may use in parts per million, 0 for unlimited");
+#endif
+
+static unsigned int charge_timeout_ms = 1000;
+module_param(charge_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(charge_timeout_ms, "Time after which a charge that hasn't reached the input pin is abandoned");
+
+static bool raw_samples = false;
+module_param(raw_samples, bool, 0644);
+MODULE_PARM_DESC(raw_samples, "Skip the conversion and report charge times in ns, to be converted in user space");
+
+static unsigned int charge_mode = THERMOMETER_CHARGE_POLL;
+module_param(charge_mode, uint, 0444);
+MODULE_PARM_DESC(charge_mode, "0: poll the input pin, 1: timestamp its rising edge in the IRQ handler, 2: sleep until shortly before the predicted edge, then poll");
+
+static unsigned int hybrid_margin_pct = 10;
+module_param(hybrid_margin_pct, uint, 0644);
+MODULE_PARM_DESC(hybrid_margin_pct, "Share of the predicted charge time the hybrid mode wakes up early by");
+
+static unsigned int hybrid_slack_us = 200;
+module_param(hybrid_slack_us, uint, 0644);
+MODULE_PARM_DESC(hybrid_slack_us, "Wakeup latency the hybrid mode wakes up early by on top of hybrid_margin_pct");
+
+#ifdef CONFIG_THERMOMETER_BCM2835
+static bool fast_gpio = false;
+module_param(fast_gpio, bool, 0444);
+MODULE_PARM_DESC(fast_gpio, "Drive and poll the pins through the BCM2835 registers instead of gpiolib");
+
+static unsigned long gpio_base = THERMOMETER_BCM2835_GPIO_BASE;
+module_param(gpio_base, ulong, 0444);
+MODULE_PARM_DESC(gpio_base, "Physical address of the GPIO registers, 0x3f200000 on BCM2836/7 boards");
+#endif
+
+#ifdef CONFIG_THERMOMETER_NOWCAST
+static bool nowcast_reads = false;
+module_param_named(nowcast, nowcast_reads, bool, 0644);
+MODULE_PARM_DESC(nowcast, "Cached reads return the temperature extrapolated to the open and its uncertainty");
+#endif
+
+#ifdef CONFIG_THERMOMETER_EDGE_IRQ
+static unsigned int edge_calibrate_interval = 16;
+module_param(edge_calibrate_interval, uint, 0644);
+MODULE_PARM_DESC(edge_calibrate_interval, "Every this many charges is polled and IRQ timed on the same edge to measure the IRQ latency, 0 to never poll");
+#endif
+
+#ifdef CONFIG_THERMOMETER_HEALTH
+static unsigned int health_noise_ppm = 50000;
+module_param(health_noise_ppm, uint, 0644);
+MODULE_PARM_DESC(health_noise_ppm, "Charge time standard deviation relative to the mean above which the sensor is noisy");
+
+static unsigned int health_stuck_ppm = 100;
+module_param(health_stuck_ppm, uint, 0644);
+MODULE_PARM_DESC(health_stuck_ppm, "Charge time changes below this are considered the same value");
+
+static unsigned int health_stuck_ms = 600000;
+module_param(health_stuck_ms, uint, 0644);
+MODULE_PARM_DESC(health_stuck_ms, "Time the charge time has to stay the same for the sensor to be stuck");
+
+static unsigned int health_drift_ppm = 500000;
+module_param(health_drift_ppm, uint, 0644);
+MODULE_PARM_DESC(health_drift_ppm, "Long term charge time change from the baseline above which the sensor is drifting");
+
+static unsigned int health_timeout_ppm = 100000;
+module_param(health_timeout_ppm, uint, 0644);
+MODULE_PARM_DESC(health_timeout_ppm, "Share of timed out charges above which the sensor is failing");
+#endif
+
+#ifdef CONFIG_THERMOMETER_FLIGHT
+static unsigned long recorder_address = 0;
+module_param(recorder_address, ulong, 0444);
+MODULE_PARM_DESC(recorder_address, "Physical address of RAM reserved for the flight recorder, 0 to disable it");
+
+static unsigned long recorder_size = 0;
+module_param(recorder_size, ulong, 0444);
+MODULE_PARM_DESC(recorder_size, "Size of the RAM reserved for the flight recorder");
+#endif
+
+ThermometerDevice thermometer_device = {
+    .calibration = THERMOMETER_PROFILE_CALIBRATION,
+};
+
+module_param_named(hybrid_misses, thermometer_device.charge_misses, uint, 0444);
+MODULE_PARM_DESC(hybrid_misses, "Number of hybrid charges that slept past the edge and were retaken polled");
+
+#ifdef CONFIG_THERMOMETER_SIMULATE
+static bool simulate = false;
+module_param(simulate, bool, 0444);
+MODULE_PARM_DESC(simulate, "Run on a virtual clock and a charge time model instead of the pins, advanced by THERMOMETER_IOC_SIMULATE_ADVANCE");
+
+static unsigned int simulate_charge_us = 100000;
+module_param(simulate_charge_us, uint, 0644);
+MODULE_PARM_DESC(simulate_charge_us, "Mean charge time of the simulated sensor");
+
+static unsigned int simulate_swing_us = 20000;
+module_param(simulate_swing_us, uint, 0644);
+MODULE_PARM_DESC(simulate_swing_us, "Amplitude of the simulated sensor's charge time cycle");
+
+static unsigned int simulate_period_s = 86400;
+module_param(simulate_period_s, uint, 0644);
+MODULE_PARM_DESC(simulate_period_s, "Period of the simulated sensor's charge time cycle");
+
+static unsigned int simulate_noise_ns = 50000;
+module_param(simulate_noise_ns, uint, 0644);
+MODULE_PARM_DESC(simulate_noise_ns, "Largest random error added to each simulated charge time");
+
+module_param_named(simulate_now_ns, thermometer_device.simulation.now, ullong, 0444);
+MODULE_PARM_DESC(simulate_now_ns, "The virtual monotonic time");
+
+module_param_named(simulate_ticks, thermometer_device.simulation.ticks, ullong, 0444);
+MODULE_PARM_DESC(simulate_ticks, "Number of sampler ticks run in virtual time");
+#endif
+
+#ifdef CONFIG_THERMOMETER_CPUFREQ
+module_param_named(cpufreq_transitions, thermometer_device.cpufreq.transitions, uint, 0444);
+MODULE_PARM_DESC(cpufreq_transitions, "Number of CPU frequency transitions seen");
+
+static int thermometer_cpufreq_get(char *buffer, const struct kernel_param *kp)
+{
+    ThermometerCpufreq *cpufreq = &thermometer_device.cpufreq;
+    u32 entries = min_t(u32, READ_ONCE(cpufreq->entries), THERMOMETER_CPUFREQ_ENTRIES);
+    int length = 0;
+    u32 i;
+
+    for (i = 0; i < entries; i++)
+        length += sysfs_emit_at(buffer, length, "%u kHz %u ns\n", cpufreq->table[i].khz,
+                                cpufreq->table[i].overhead);
+
+    return length;
+}
+
+static const struct kernel_param_ops thermometer_cpufreq_ops = {
+    .get = thermometer_cpufreq_get,
+};
+
+module_param_cb(cpufreq_overhead, &thermometer_cpufreq_ops, NULL, 0444);
+MODULE_PARM_DESC(cpufreq_overhead, "Charge overhead calibrated at each CPU frequency");
+#endif
+
+#ifdef CONFIG_THERMOMETER_RING
+module_param_named(stale, thermometer_device.ring.stale, bool, 0444);
+MODULE_PARM_DESC(stale, "Whether the watchdog considers the newest sample out of date");
+#endif
+
+#ifdef CONFIG_THERMOMETER_SAMPLER
+module_param_named(watchdog_recoveries, thermometer_device.sampler.recoveries, uint, 0444);
+MODULE_PARM_DESC(watchdog_recoveries, "Number of times the watchdog restarted a stalled sampler");
+#endif
+
+#ifdef CONFIG_THERMOMETER_BUDGET
+module_param_named(cpu_usage_ppm, thermometer_device.budget.usage_ppm, uint, 0444);
+MODULE_PARM_DESC(cpu_usage_ppm, "Share of CPU time spent measuring over the last 10 seconds in parts per million");
+
+module_param_named(cpu_budget_skipped, thermometer_device.budget.skipped_count, ullong, 0444);
+MODULE_PARM_DESC(cpu_budget_skipped, "Number of measurements skipped to stay within cpu_budget_ppm");
+#endif
+
+#ifdef CONFIG_THERMOMETER_RATE_LIMIT
+module_param_named(rate_limited, thermometer_device.rate_limiter.limited_count, ullong, 0444);
+MODULE_PARM_DESC(rate_limited, "Number of opens served from the cached sample because a rate limit was reached");
+
+// guards the per-uid table on its own so the param getter never needs the device mutex
+static DEFINE_MUTEX(thermometer_uid_bucket_mutex);
+
+static int thermometer_rate_limited_uids_get(char *buffer, const struct kernel_param *kp)
+{
+    ThermometerRateLimiter *limiter = &thermometer_device.rate_limiter;
+    ThermometerUidBucket *entry;
+    int length = 0;
+    int bkt;
+
+    if (mutex_lock_interruptible(&thermometer_uid_bucket_mutex) != 0)
+        return -ERESTARTSYS;
+
+    hash_for_each(limiter->uid_buckets, bkt, entry, node)
+    {
+        if (entry->limited_count != 0)
+            length += sysfs_emit_at(buffer, length, "%u %llu\n",
+                                    from_kuid_munged(current_user_ns(), entry->uid), entry->limited_count);
+    }
+
+    mutex_unlock(&thermometer_uid_bucket_mutex);
+
+    return length;
+}
+
+static const struct kernel_param_ops thermometer_rate_limited_uids_ops = {
+    .get = thermometer_rate_limited_uids_get,
+};
+
+module_param_cb(rate_limited_uids, &thermometer_rate_limited_uids_ops, NULL, 0444);
+MODULE_PARM_DESC(rate_limited_uids, "Opens served from the cached sample by uid_rate_limit, as uid and count lines");
+#endif
+
+#ifdef CONFIG_THERMOMETER_EDGE_IRQ
+module_param_named(edge_latency_ns, thermometer_device.edge.latency, uint, 0444);
+MODULE_PARM_DESC(edge_latency_ns, "Measured IRQ entry latency subtracted from the edge timestamps");
+#endif
+
+#ifdef CONFIG_THERMOMETER_HEALTH
+static const char *const thermometer_health_names[] = {
+    [THERMOMETER_HEALTH_OK] = "ok",
+    [THERMOMETER_HEALTH_DRIFTING] = "drifting",
+    [THERMOMETER_HEALTH_NOISY] = "noisy",
+    [THERMOMETER_HEALTH_STUCK] = "stuck",
+    [THERMOMETER_HEALTH_FAILING] = "failing",
+};
+
+static int thermometer_health_get(char *buffer, const struct kernel_param *kp)
+{
+    u32 state = READ_ONCE(thermometer_device.health.metrics.state);
+
+    return sysfs_emit(buffer, "%s\n", thermometer_health_names[state]);
+}
+
+static const struct kernel_param_ops thermometer_health_ops = {
+    .get = thermometer_health_get,
+};
+
+module_param_cb(health, &thermometer_health_ops, NULL, 0444);
+MODULE_PARM_DESC(health, "Health state of the sensor");
+#endif
+
+#ifdef CONFIG_THERMOMETER_COST
+static const char *const thermometer_cost_names[] = {
+    [THERMOMETER_COST_TRIGGER] = "trigger",
+    [THERMOMETER_COST_IRQ] = "irq",
+    [THERMOMETER_COST_DISCHARGE] = "discharge",
+    [THERMOMETER_COST_CHARGE_BUSY] = "charge_busy",
+    [THERMOMETER_COST_CHARGE_SLEEP] = "charge_sleep",
+    [THERMOMETER_COST_CONVERSION] = "conversion",
+    [THERMOMETER_COST_PUBLICATION] = "publication",
+    [THERMOMETER_COST_CPU] = "cpu",
+};
+
+static int thermometer_cost_compare(const void *a, const void *b)
+{
+    u32 left = *(const u32 *)a;
+    u32 right = *(const u32 *)b;
+
+    return (left > right) - (left < right);
+}
+
+static int thermometer_cost_get(char *buffer, const struct kernel_param *kp)
+{
+    ThermometerCostTracker *costs = &thermometer_device.costs;
+    u32 window[THERMOMETER_COST_WINDOW];
+    u32 count = min_t(u64, READ_ONCE(costs->samples), THERMOMETER_COST_WINDOW);
+    int length;
+    int phase;
+
+    length = sysfs_emit(buffer, "%-12s %10s %10s %10s %10s %10s\n", "phase", "mean_ns", "p50_ns", "p90_ns",
+                        "p99_ns", "max_ns");
+    if (count == 0)
+        return length;
+
+    // the window is copied without the device mutex, a sample racing with it only skews one entry
+    for (phase = 0; phase < THERMOMETER_COST_PHASES; phase++)
+    {
+        memcpy(window, costs->window[phase], count * sizeof(u32));
+        sort(window, count, sizeof(u32), thermometer_cost_compare, NULL);
+
+        length += sysfs_emit_at(buffer, length, "%-12s %10u %10u %10u %10u %10u\n", thermometer_cost_names[phase],
+                                READ_ONCE(costs->mean[phase]), window[count * 50 / 100],
+                                window[count * 90 / 100], window[count * 99 / 100], window[count - 1]);
+    }
+
+    return length;
+}
+
+static const struct kernel_param_ops thermometer_cost_ops = {
+    .get = thermometer_cost_get,
+};
+
+module_param_cb(cost, &thermometer_cost_ops, NULL, 0444);
+MODULE_PARM_DESC(cost, "Cost breakdown of the recent samples");
+#endif
+
+int time_to_resistance(const ThermometerCalibration *calibration, u64 time_elapsed)
+{
+    return thermometer_convert_resistance(calibration, time_elapsed);
+}
+
+#ifdef THERMOMETER_USE_LUT
+int thermometer_lut_lookup(int resistance)
+{
+    return thermometer_convert_lut(thermometer_lut, THERMOMETER_LUT_ENTRIES, resistance);
+}
+#endif
+
+int resistance_to_temperature(const ThermometerCalibration *calibration, int resistance)
+{
+#ifdef THERMOMETER_USE_LUT
+    return DIV_ROUND_CLOSEST(thermometer_lut_lookup(resistance), 1000);
+#else
+    return thermometer_convert_linear(calibration, resistance);
+#endif
+}
+
+#ifdef CONFIG_THERMOMETER_RING
+int thermometer_ring_init(ThermometerRing *ring, unsigned int pages)
+{
+    unsigned long data_size;
+
+    if (pages == 0)
+        pages = 1;
+
+    pages = roundup_pow_of_two(pages);
+    data_size = (unsigned long)pages * PAGE_SIZE;
+    ring->size = data_size + PAGE_SIZE;
+
+    ring->page = vmalloc_user(ring->size);
+    ring->tail = vmalloc_user(PAGE_SIZE);
+    if (ring->page == NULL || ring->tail == NULL)
+    {
+        thermometer_ring_free(ring);
+        return -ENOMEM;
+    }
+
+    ring->samples = (ThermometerSample *)((char *)ring->page + PAGE_SIZE);
+    BUILD_BUG_ON(!is_power_of_2(sizeof(ThermometerSample)));
+    ring->capacity = data_size / sizeof(ThermometerSample);
+
+    ring->page->version = THERMOMETER_RING_VERSION;
+    ring->page->sample_size = sizeof(ThermometerSample);
+    ring->page->data_offset = PAGE_SIZE;
+    ring->page->data_size = data_size;
+    ring->page->tail_offset = ring->size;
+
+    init_waitqueue_head(&ring->wait);
+
+    return 0;
+}
+
+void thermometer_ring_free(ThermometerRing *ring)
+{
+    vfree(ring->page);
+    vfree(ring->tail);
+    ring->page = NULL;
+    ring->tail = NULL;
+    ring->samples = NULL;
+}
+
+void thermometer_ring_update_offsets(ThermometerRing *ring, u64 now)
+{
+    ThermometerRingPage *page = ring->page;
+    ktime_t mono = ns_to_ktime(now);
+    u32 seq = page->offsets_seq;
+
+    WRITE_ONCE(page->offsets_seq, seq + 1);
+    smp_wmb();
+
+    page->offset_boot = ktime_to_ns(ktime_sub(ktime_mono_to_any(mono, TK_OFFS_BOOT), mono));
+    page->offset_real = ktime_to_ns(ktime_sub(ktime_mono_to_any(mono, TK_OFFS_REAL), mono));
+    page->offset_tai = ktime_to_ns(ktime_sub(ktime_mono_to_any(mono, TK_OFFS_TAI), mono));
+
+    smp_wmb();
+    WRITE_ONCE(page->offsets_seq, seq + 2);
+}
+
+void thermometer_ring_publish(ThermometerRing *ring, const ThermometerSample *sample)
+{
+    u64 head = ring->head;
+
+    thermometer_ring_update_offsets(ring, sample->timestamp);
+
+    ring->samples[head & (ring->capacity - 1)] = *sample;
+
+    // make the sample visible before the reader can see the new head
+    WRITE_ONCE(ring->head, head + 1);
+    smp_store_release(&ring->page->data_head, head + 1);
+
+    wake_up_interruptible(&ring->wait);
+}
+
+void thermometer_ring_set_stale(ThermometerRing *ring, bool stale)
+{
+    WRITE_ONCE(ring->stale, stale);
+    WRITE_ONCE(ring->page->stale, stale ? 1 : 0);
+}
+
+void thermometer_ring_mark_imported(ThermometerRing *ring)
+{
+    WRITE_ONCE(ring->import_end, ring->head);
+}
+
+u64 thermometer_ring_find(const ThermometerRing *ring, u64 timestamp)
+{
+    u64 head = ring->head;
+    u64 low = head > ring->capacity ? head - ring->capacity : 0;
+    u64 high = head;
+
+    low = max(low, ring->import_end);
+
+    // the timestamps only increase after the imported samples, so the first one at or after timestamp
+    // is found in log2(capacity) steps
+    while (low < high)
+    {
+        u64 middle = low + (high - low) / 2;
+
+        if (ring->samples[middle & (ring->capacity - 1)].timestamp < timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+/// @brief Copies the samples from sequence on, which are contiguous in the ring up to the wrap
+static int thermometer_ring_copy(const ThermometerRing *ring, ThermometerSample __user *buffer, u64 sequence,
+                                 u32 count)
+{
+    u32 index = sequence & (ring->capacity - 1);
+    u32 first = min(count, ring->capacity - index);
+
+    if (copy_to_user(buffer, &ring->samples[index], (size_t)first * sizeof(ThermometerSample)) != 0)
+        return -EFAULT;
+    if (copy_to_user(buffer + first, ring->samples, (size_t)(count - first) * sizeof(ThermometerSample)) != 0)
+        return -EFAULT;
+
+    return 0;
+}
+
+long thermometer_ring_ioctl(ThermometerDevice *device, unsigned int cmd, unsigned long arg, u64 *sequence)
+{
+    ThermometerRing *ring = &device->ring;
+    ThermometerRange range;
+    long result = 0;
+
+    if (cmd != THERMOMETER_IOC_FIND && cmd != THERMOMETER_IOC_READ_RANGE)
+        return -ENOTTY;
+
+    if (copy_from_user(&range, (void __user *)arg, sizeof(range)) != 0)
+        return -EFAULT;
+
+    if (cmd == THERMOMETER_IOC_READ_RANGE && range.from > range.to)
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(device->device_mutex) != 0)
+        return -ERESTARTSYS;
+
+    range.sequence = thermometer_ring_find(ring, range.from);
+
+    if (cmd == THERMOMETER_IOC_READ_RANGE)
+    {
+        // the end of the range is searched as well, so only the samples asked for are touched
+        u64 end = thermometer_ring_find(ring, range.to);
+
+        range.count = min_t(u64, range.count, end - range.sequence);
+        result = thermometer_ring_copy(ring, u64_to_user_ptr(range.buffer), range.sequence, range.count);
+    }
+
+    if (sequence != NULL)
+        *sequence = range.sequence;
+
+    mutex_unlock(device->device_mutex);
+
+    if (result == 0 && copy_to_user((void __user *)arg, &range, sizeof(range)) != 0)
+        result = -EFAULT;
+
+    return result;
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_BCM2835
+int thermometer_gpio_map(ThermometerDevice *device)
+{
+    if (!fast_gpio)
+        return 0;
+
+    device->gpio_regs = ioremap(gpio_base, THERMOMETER_BCM2835_GPIO_SIZE);
+    if (device->gpio_regs == NULL)
+        return -ENOMEM;
+
+    return 0;
+}
+
+void thermometer_gpio_unmap(ThermometerDevice *device)
+{
+    if (device->gpio_regs != NULL)
+        iounmap(device->gpio_regs);
+
+    device->gpio_regs = NULL;
+}
+#endif
+
+static void thermometer_set_output(ThermometerDevice *device, int value)
+{
+#ifdef CONFIG_THERMOMETER_BCM2835
+    if (device->gpio_regs != NULL)
+    {
+        thermometer_bcm2835_set_level(device->gpio_regs, OUTPUT_BCM_PIN, value);
+        return;
+    }
+#endif
+
+    gpio_set_value(OUTPUT_PIN, value);
+}
+
+static int thermometer_get_input(ThermometerDevice *device)
+{
+#ifdef CONFIG_THERMOMETER_BCM2835
+    if (device->gpio_regs != NULL)
+        return thermometer_bcm2835_get_level(device->gpio_regs, INPUT_BCM_PIN);
+#endif
+
+    return gpio_get_value(INPUT_PIN);
+}
+
+#ifdef CONFIG_THERMOMETER_CPUFREQ
+static int thermometer_cpufreq_transition(struct notifier_block *notifier, unsigned long event, void *data)
+{
+    ThermometerCpufreq *cpufreq = container_of(notifier, ThermometerCpufreq, notifier);
+    struct cpufreq_freqs *freqs = (struct cpufreq_freqs *)data;
+
+    // other policies' CPUs don't run the measurement.  A charge that migrates to another CPU
+    // halfway is not flagged, the Pi Zero this is written for has a single one.
+    if (!cpumask_test_cpu(READ_ONCE(cpufreq->cpu), freqs->policy->cpus))
+        return NOTIFY_OK;
+
+    // a charge overlapping either edge of the transition ran at a mix of both frequencies
+    WRITE_ONCE(cpufreq->generation, cpufreq->generation + 1);
+
+    if (event == CPUFREQ_POSTCHANGE)
+    {
+        WRITE_ONCE(cpufreq->khz, freqs->new);
+        cpufreq->transitions++;
+    }
+
+    return NOTIFY_OK;
+}
+
+int thermometer_cpufreq_init(ThermometerDevice *device)
+{
+    ThermometerCpufreq *cpufreq = &device->cpufreq;
+    int result;
+
+    cpufreq->cpu = raw_smp_processor_id();
+    cpufreq->khz = cpufreq_quick_get(cpufreq->cpu);
+    cpufreq->notifier.notifier_call = thermometer_cpufreq_transition;
+
+    result = cpufreq_register_notifier(&cpufreq->notifier, CPUFREQ_TRANSITION_NOTIFIER);
+    if (result == -EINVAL)
+    {
+        printk(KERN_INFO "CPUFREQ: cpufreq is disabled, assuming a fixed frequency\n");
+        cpufreq->khz = 0;
+        return 0;
+    }
+    if (result != 0)
+        return result;
+
+    cpufreq->registered = true;
+
+    return 0;
+}
+
+void thermometer_cpufreq_free(ThermometerDevice *device)
+{
+    if (device->cpufreq.registered)
+        cpufreq_unregister_notifier(&device->cpufreq.notifier, CPUFREQ_TRANSITION_NOTIFIER);
+
+    device->cpufreq.registered = false;
+}
+
+u32 thermometer_cpufreq_overhead(ThermometerDevice *device)
+{
+    ThermometerCpufreq *cpufreq = &device->cpufreq;
+    int cpu = raw_smp_processor_id();
+    unsigned int khz;
+    ThermometerOverhead *entry;
+    u64 start;
+    u64 read_cost;
+    u64 set_cost;
+    u32 i;
+
+    // the measurement moved to another CPU, whose frequency may differ
+    if (cpu != cpufreq->cpu)
+    {
+        WRITE_ONCE(cpufreq->cpu, cpu);
+        if (cpufreq->registered)
+            WRITE_ONCE(cpufreq->khz, cpufreq_quick_get(cpu));
+    }
+    khz = READ_ONCE(cpufreq->khz);
+
+    for (i = 0; i < cpufreq->entries; i++)
+    {
+        if (cpufreq->table[i].khz == khz)
+            return cpufreq->table[i].overhead;
+    }
+
+    // the charge starts when the output write lands and is seen one read after the edge on
+    // average half a read late, so the overhead is one write and one and a half reads
+    start = ktime_get_mono_fast_ns();
+    for (i = 0; i < THERMOMETER_CPUFREQ_READS; i++)
+        thermometer_get_input(device);
+    read_cost = div_u64(ktime_get_mono_fast_ns() - start, THERMOMETER_CPUFREQ_READS);
+
+    start = ktime_get_mono_fast_ns();
+    for (i = 0; i < THERMOMETER_CPUFREQ_READS; i++)
+        thermometer_set_output(device, 0);
+    set_cost = div_u64(ktime_get_mono_fast_ns() - start, THERMOMETER_CPUFREQ_READS);
+
+    if (cpufreq->entries < THERMOMETER_CPUFREQ_ENTRIES)
+        entry = &cpufreq->table[cpufreq->entries];
+    else
+        entry = &cpufreq->table[cpufreq->next++ % THERMOMETER_CPUFREQ_ENTRIES];
+
+    entry->khz = khz;
+    entry->overhead = (u32)min_t(u64, set_cost + read_cost + read_cost / 2, U32_MAX);
+    if (cpufreq->entries < THERMOMETER_CPUFREQ_ENTRIES)
+        WRITE_ONCE(cpufreq->entries, cpufreq->entries + 1);
+
+    printk(KERN_INFO "CPUFREQ: Charge overhead at %u kHz is %u ns\n", khz, entry->overhead);
+
+    return entry->overhead;
+}
+#endif
+
+static int thermometer_charge_spin(ThermometerDevice *device, u64 start, u64 *end)
+{
+    unsigned int iterations = 0;
+    u64 deadline = start + (u64)READ_ONCE(charge_timeout_ms) * NSEC_PER_MSEC;
+
+#ifdef CONFIG_THERMOMETER_BCM2835
+    if (device->gpio_regs != NULL)
+    {
+        while (thermometer_bcm2835_wait_high(device->gpio_regs, INPUT_BCM_PIN, 1024) == 0)
+        {
+            if (ktime_get_mono_fast_ns() > deadline)
+                return -ETIMEDOUT;
+        }
+
+        *end = ktime_get_mono_fast_ns();
+
+        return 0;
+    }
+#endif
+
+    while (gpio_get_value(INPUT_PIN) != 1)
+    {
+        // reading the clock on every iteration would cost timing resolution
+        if ((++iterations & 1023U) == 0 && ktime_get_mono_fast_ns() > deadline)
+            return -ETIMEDOUT;
+    }
+
+    *end = ktime_get_mono_fast_ns();
+
+    return 0;
+}
+
+static int thermometer_charge_poll(ThermometerDevice *device, u64 *start, u64 *end)
+{
+    *start = ktime_get_mono_fast_ns();
+    thermometer_set_output(device, 1);
+
+    return thermometer_charge_spin(device, *start, end);
+}
+
+static int thermometer_charge_hybrid(ThermometerDevice *device, u64 predicted, u64 *start, u64 *end, u64 *slept)
+{
+    u64 margin = div_u64(predicted * READ_ONCE(hybrid_margin_pct), 100) +
+                 (u64)READ_ONCE(hybrid_slack_us) * NSEC_PER_USEC;
+    ktime_t wakeup;
+
+    *start = ktime_get_mono_fast_ns();
+    thermometer_set_output(device, 1);
+
+    // without a previous sample, or for charges shorter than the margin, there is nothing to sleep through
+    if (predicted > margin)
+    {
+        wakeup = ns_to_ktime(*start + predicted - margin);
+        set_current_state(TASK_UNINTERRUPTIBLE);
+        schedule_hrtimeout_range(&wakeup, 0, HRTIMER_MODE_ABS);
+        *slept = ktime_get_mono_fast_ns() - *start;
+
+        // the edge passed while sleeping, so when it happened is unknown
+        if (thermometer_get_input(device) == 1)
+            return -EAGAIN;
+    }
+
+    return thermometer_charge_spin(device, *start, end);
+}
+
+#ifdef CONFIG_THERMOMETER_EDGE_IRQ
+static irqreturn_t thermometer_edge_irq(int irq, void *data)
+{
+    ThermometerEdge *edge = (ThermometerEdge *)data;
+    // taken before anything else, this is the earliest timestamp of the edge available
+    u64 now = ktime_get_mono_fast_ns();
+
+    // a resent or bouncing edge while the pin is low belongs to no charge
+    if (!READ_ONCE(edge->armed) || gpio_get_value(INPUT_PIN) != 1)
+        return IRQ_HANDLED;
+
+    edge->time = now;
+    WRITE_ONCE(edge->armed, false);
+    complete(&edge->done);
+
+    return IRQ_HANDLED;
+}
+
+static int thermometer_charge_edge(ThermometerDevice *device, u64 *start, u64 *end)
+{
+    ThermometerEdge *edge = &device->edge;
+
+    reinit_completion(&edge->done);
+    WRITE_ONCE(edge->armed, true);
+
+    *start = ktime_get_mono_fast_ns();
+    thermometer_set_output(device, 1);
+
+    if (wait_for_completion_timeout(&edge->done, msecs_to_jiffies(READ_ONCE(charge_timeout_ms))) == 0)
+    {
+        WRITE_ONCE(edge->armed, false);
+        return -ETIMEDOUT;
+    }
+
+    *end = edge->time;
+
+    return 0;
+}
+
+/// @brief A polled charge that also takes the IRQ of the same edge, to measure the IRQ entry latency
+/// @note the poll sees the edge first only if interrupts are off when it comes, so they are turned
+/// off for a short window around the predicted edge.  An edge outside the window gives no latency.
+static int thermometer_charge_edge_calibrate(ThermometerDevice *device, u64 predicted, u64 *start, u64 *end)
+{
+    ThermometerEdge *edge = &device->edge;
+    u64 opening = predicted > THERMOMETER_EDGE_WINDOW_NS ? predicted - THERMOMETER_EDGE_WINDOW_NS : 0;
+    unsigned long flags;
+    u64 deadline;
+    u64 latency;
+    bool high;
+    int result = 0;
+
+    reinit_completion(&edge->done);
+    edge->time = 0;
+    WRITE_ONCE(edge->armed, true);
+
+    *start = ktime_get_mono_fast_ns();
+    thermometer_set_output(device, 1);
+
+    while (ktime_get_mono_fast_ns() - *start < opening && thermometer_get_input(device) != 1)
+        cpu_relax();
+
+    local_irq_save(flags);
+    deadline = ktime_get_mono_fast_ns() + 2 * THERMOMETER_EDGE_WINDOW_NS;
+    while (!(high = thermometer_get_input(device) == 1) && ktime_get_mono_fast_ns() < deadline)
+        cpu_relax();
+    *end = ktime_get_mono_fast_ns();
+    local_irq_restore(flags);
+
+    if (!high)
+        result = thermometer_charge_spin(device, *start, end);
+
+    // the edge IRQ held back by the window comes in now, or already ran on another CPU
+    wait_for_completion_timeout(&edge->done, 1);
+    WRITE_ONCE(edge->armed, false);
+
+    // an edge before the window was taken by the IRQ first, and its latency can't be told
+    if (result != 0 || !high || edge->time <= *end)
+        return result;
+
+    latency = edge->time - *end;
+    if (latency > THERMOMETER_EDGE_MAX_LATENCY_NS)
+        return 0;
+
+    if (edge->latency_samples++ == 0)
+        edge->latency_mean = latency;
+    else
+        edge->latency_mean += (s64)(latency - edge->latency_mean) >> THERMOMETER_EDGE_SHIFT;
+    WRITE_ONCE(edge->latency, (unsigned int)edge->latency_mean);
+
+    return 0;
+}
+
+int thermometer_edge_init(ThermometerEdge *edge)
+{
+    int irq;
+    int result;
+
+    edge->irq = -1;
+    init_completion(&edge->done);
+
+    if (charge_mode != THERMOMETER_CHARGE_EDGE)
+        return 0;
+
+    irq = gpio_to_irq(INPUT_PIN);
+    if (irq < 0)
+        return irq;
+
+    // the input pin only rises while charging, so the IRQ can stay enabled in between
+    result = request_irq(irq, thermometer_edge_irq, IRQF_TRIGGER_RISING, "thermometer-edge", edge);
+    if (result != 0)
+        return result;
+
+    edge->irq = irq;
+
+    return 0;
+}
+
+void thermometer_edge_free(ThermometerEdge *edge)
+{
+    if (edge->irq >= 0)
+        free_irq(edge->irq, edge);
+
+    edge->irq = -1;
+}
+#endif
+
+int thermometer_charge(ThermometerDevice *device, u64 *start, u64 *end, u64 *slept)
+{
+#ifdef CONFIG_THERMOMETER_EDGE_IRQ
+    ThermometerEdge *edge = &device->edge;
+    unsigned int interval = READ_ONCE(edge_calibrate_interval);
+    u64 charge_time;
+#endif
+    int result;
+
+    *slept = 0;
+
+    if (thermometer_simulated(device))
+        return thermometer_simulation_charge(device, start, end, slept);
+
+#ifdef CONFIG_THERMOMETER_EDGE_IRQ
+    if (edge->irq >= 0)
+    {
+        // every interval-th charge is polled and timed by the IRQ as well, the difference on the
+        // same edge keeps the latency model current
+        if (interval != 0 && ++edge->charges % interval == 0)
+            return thermometer_charge_edge_calibrate(device, device->last_sample.charge_time, start, end);
+
+        result = thermometer_charge_edge(device, start, end);
+        if (result != 0)
+        {
+            *slept = ktime_get_mono_fast_ns() - *start;
+            return result;
+        }
+
+        charge_time = *end - *start;
+        *end -= min_t(u64, READ_ONCE(edge->latency), charge_time);
+        *slept = *end - *start;
+
+        return result;
+    }
+#endif
+
+    if (charge_mode != THERMOMETER_CHARGE_HYBRID)
+        return thermometer_charge_poll(device, start, end);
+
+    result = thermometer_charge_hybrid(device, device->last_sample.charge_time, start, end, slept);
+    if (result != -EAGAIN)
+        return result;
+
+    // the charge can't be timed after oversleeping its edge, so it is retaken polled
+    device->charge_misses++;
+    thermometer_set_output(device, 0);
+    msleep(THERMOMETER_DISCHARGE_MS);
+    *slept = 0;
+
+    return thermometer_charge_poll(device, start, end);
+}
+
+int thermometer_measure(ThermometerDevice *device, u16 trigger, u64 trigger_time)
+{
+    u64 phases[THERMOMETER_COST_PHASES];
+    u64 discharge_start;
+    u64 converted;
+    u64 start;
+    u64 end;
+    u64 slept;
+    u64 now;
+    u32 overhead;
+    u32 generation;
+    int result;
+    int resistance = 0;
+    int temperature = 0;
+    bool health_changed;
+    bool raw;
+    ThermometerSample sample;
+
+    discharge_start = thermometer_cost_clock();
+    thermometer_set_output(device, 0);
+    // the model's charge times carry no pin access overhead
+    overhead = thermometer_simulated(device) ? 0 : thermometer_cpufreq_overhead(device);
+
+    if (thermometer_simulated(device))
+        thermometer_simulation_sleep(device, THERMOMETER_DISCHARGE_MS);
+    else
+        msleep(THERMOMETER_DISCHARGE_MS);
+
+    generation = thermometer_cpufreq_generation(device);
+    result = thermometer_charge(device, &start, &end, &slept);
+    if (result != 0)
+    {
+        thermometer_set_output(device, 0);
+        // don't let the reader that asked for this measurement take the previous one for it
+        device->temperature[0] = '\0';
+        now = thermometer_clock(device);
+        thermometer_health_update(device, 0, true, now);
+        thermometer_flight_record(&device->flight, THERMOMETER_FLIGHT_TIMEOUT,
+                                  device->last_sample.temperature, 0, now);
+        thermometer_budget_charge(&device->budget, now - start - slept, now);
+        printk_ratelimited(KERN_WARNING "MEASURE: Charge timed out\n");
+        return result;
+    }
+
+    // edge timed charges are mapped onto polled ones by their latency model, so this applies to both
+    end -= min_t(u64, overhead, end - start);
+
+    // raw samples leave the temperature at 0 and the conversion to thermometer_bulk.h
+    raw = READ_ONCE(raw_samples);
+    if (raw)
+    {
+        snprintf(device->temperature, TEMPERATURE_LENGTH, "%llu\n", end - start);
+    }
+    else
+    {
+        resistance = time_to_resistance(&device->calibration, end - start);
+        temperature = resistance_to_temperature(&device->calibration, resistance);
+
+        snprintf(device->temperature, TEMPERATURE_LENGTH, "%d\n", temperature);
+    }
+    converted = thermometer_cost_clock();
+
+    thermometer_set_output(device, 0);
+
+    health_changed = thermometer_health_update(device, end - start, false, end);
+    thermometer_nowcast_update(&device->nowcast, end - start, end);
+
+    sample = (ThermometerSample){0};
+    sample.timestamp = end;
+    sample.charge_time = (u32)min_t(u64, end - start, U32_MAX);
+    sample.temperature = temperature;
+    sample.trigger = trigger;
+    sample.trigger_latency = start > trigger_time ? (u32)min_t(u64, start - trigger_time, U32_MAX) : 0;
+    sample.flags = health_changed ? THERMOMETER_SAMPLE_HEALTH_CHANGED : 0;
+    if (thermometer_cpufreq_generation(device) != generation)
+        sample.flags |= THERMOMETER_SAMPLE_FREQ_CHANGED;
+    if (raw)
+        sample.flags |= THERMOMETER_SAMPLE_RAW;
+    thermometer_ring_publish(&device->ring, &sample);
+    device->last_sample = sample;
+    thermometer_sampler_progress(device, end);
+    thermometer_ring_set_stale(&device->ring, false);
+    thermometer_flight_record(&device->flight, THERMOMETER_FLIGHT_SAMPLE, temperature, trigger, end);
+
+    // the discharge and parts of the charge sleep, they don't count as CPU time
+    now = thermometer_clock(device);
+    thermometer_budget_charge(&device->budget, now - start - slept, now);
+
+    phases[THERMOMETER_COST_TRIGGER] = sample.trigger_latency;
+    phases[THERMOMETER_COST_IRQ] = thermometer_edge_latency(&device->edge);
+    phases[THERMOMETER_COST_DISCHARGE] = start - discharge_start;
+    phases[THERMOMETER_COST_CHARGE_BUSY] = end - start - min(slept, end - start);
+    phases[THERMOMETER_COST_CHARGE_SLEEP] = min(slept, end - start);
+    phases[THERMOMETER_COST_CONVERSION] = converted - end;
+    phases[THERMOMETER_COST_PUBLICATION] = now - converted;
+    phases[THERMOMETER_COST_CPU] = now - start - slept;
+    // the phases mix the virtual clock with the real one, they'd only skew the breakdown
+    if (!thermometer_simulated(device))
+        thermometer_cost_record(&device->costs, phases);
+
+    return 0;
+}
+
+#ifdef CONFIG_THERMOMETER_NOWCAST
+void thermometer_nowcast_update(ThermometerNowcast *nowcast, u64 charge_time, u64 now)
+{
+    u64 elapsed = now - nowcast->last_time;
+    s64 predicted;
+    s64 residual;
+
+    // samples counts the ones that updated the filter, so the seeding below waits for the first
+    // sample with elapsed time rather than simply the second one
+    if (nowcast->samples == 0 || elapsed == 0)
+    {
+        nowcast->level = charge_time;
+        nowcast->last_time = now;
+        nowcast->samples = max(nowcast->samples, 1U);
+        return;
+    }
+    nowcast->samples++;
+
+    // Holt's linear filter, the trend is kept per second so it doesn't depend on the interval
+    predicted = nowcast->level + div_s64(nowcast->trend * (s64)div_u64(elapsed, NSEC_PER_USEC), USEC_PER_SEC);
+    residual = (s64)charge_time - predicted;
+
+    nowcast->level = predicted + (residual >> THERMOMETER_NOWCAST_LEVEL_SHIFT);
+    nowcast->trend += div64_s64(residual * NSEC_PER_SEC, elapsed) >> THERMOMETER_NOWCAST_TREND_SHIFT;
+
+    if (nowcast->samples == 2)
+    {
+        nowcast->residual = abs(residual);
+        nowcast->interval = elapsed;
+    }
+    else
+    {
+        nowcast->residual += ((s64)abs(residual) - (s64)nowcast->residual) >> THERMOMETER_NOWCAST_RESIDUAL_SHIFT;
+        nowcast->interval += ((s64)elapsed - (s64)nowcast->interval) >> THERMOMETER_NOWCAST_RESIDUAL_SHIFT;
+    }
+
+    nowcast->last_time = now;
+}
+
+static int thermometer_nowcast_temperature(ThermometerDevice *device, s64 charge_time)
+{
+    u64 clamped = clamp_t(s64, charge_time, 0, S64_MAX);
+
+    return resistance_to_temperature(&device->calibration, time_to_resistance(&device->calibration, clamped));
+}
+
+void thermometer_nowcast_save(const ThermometerNowcast *nowcast, ThermometerStateFilters *filters)
+{
+    filters->nowcast_samples = nowcast->samples;
+    filters->nowcast_level = nowcast->level;
+    filters->nowcast_trend = nowcast->trend;
+    filters->nowcast_residual = nowcast->residual;
+    filters->nowcast_interval = nowcast->interval;
+    filters->nowcast_time = nowcast->last_time;
+}
+
+void thermometer_nowcast_restore(ThermometerNowcast *nowcast, const ThermometerStateFilters *filters, u64 now)
+{
+    u64 horizon = filters->nowcast_interval * THERMOMETER_NOWCAST_MAX_INTERVALS;
+
+    if (filters->nowcast_samples == 0)
+        return;
+
+    nowcast->samples = filters->nowcast_samples;
+    nowcast->level = filters->nowcast_level;
+    nowcast->trend = filters->nowcast_trend;
+    nowcast->residual = filters->nowcast_residual;
+    nowcast->interval = filters->nowcast_interval;
+    nowcast->last_time = filters->nowcast_time;
+
+    // across a reboot, or after a long gap, the level can't be carried forward along the trend, so
+    // the next sample is predicted from the level alone as if it was taken now
+    if (nowcast->last_time > now || now - nowcast->last_time > horizon)
+        nowcast->last_time = now;
+}
+
+void thermometer_nowcast_format(ThermometerDevice *device, u64 now)
+{
+    ThermometerNowcast *nowcast = &device->nowcast;
+    u64 horizon;
+    u64 spread;
+    s64 charge_time;
+    int temperature;
+    int uncertainty;
+
+    if (!READ_ONCE(nowcast_reads) || READ_ONCE(raw_samples) || nowcast->samples < 2)
+        return;
+
+    // past a few intervals without a sample the trend says little, so it isn't followed further
+    horizon = min_t(u64, now - nowcast->last_time, THERMOMETER_NOWCAST_MAX_INTERVALS * nowcast->interval);
+    charge_time = nowcast->level + div_s64(nowcast->trend * (s64)div_u64(horizon, NSEC_PER_USEC), USEC_PER_SEC);
+
+    // the typical prediction error of one interval, growing with the horizon
+    spread = nowcast->residual + div64_u64(nowcast->residual * horizon, max_t(u64, nowcast->interval, 1));
+
+    temperature = thermometer_nowcast_temperature(device, charge_time);
+    uncertainty = abs(thermometer_nowcast_temperature(device, charge_time + spread) -
+                      thermometer_nowcast_temperature(device, charge_time - spread));
+    uncertainty = DIV_ROUND_UP(uncertainty, 2);
+
+    snprintf(device->temperature, TEMPERATURE_LENGTH, "%d %d\n", temperature, uncertainty);
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_COST
+void thermometer_cost_record(ThermometerCostTracker *costs, const u64 *phases)
+{
+    u32 slot = costs->samples & (THERMOMETER_COST_WINDOW - 1);
+    u32 cost;
+    int phase;
+
+    for (phase = 0; phase < THERMOMETER_COST_PHASES; phase++)
+    {
+        cost = (u32)min_t(u64, phases[phase], U32_MAX);
+
+        if (costs->samples == 0)
+            WRITE_ONCE(costs->mean[phase], cost);
+        else
+            WRITE_ONCE(costs->mean[phase], (u32)((s64)costs->mean[phase] +
+                                                     (((s64)cost - costs->mean[phase]) >> THERMOMETER_COST_SHIFT)));
+
+        WRITE_ONCE(costs->window[phase][slot], cost);
+    }
+
+    WRITE_ONCE(costs->samples, costs->samples + 1);
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_HEALTH
+static u32 thermometer_relative_ppm(u64 difference, u64 reference)
+{
+    if (reference == 0)
+        return 0;
+
+    return (u32)min_t(u64, div64_u64(difference * 1000000ULL, reference), U32_MAX);
+}
+
+bool thermometer_health_update(ThermometerDevice *device, u64 charge_time, bool timed_out, u64 now)
+{
+    ThermometerHealthTracker *tracker = &device->health;
+    ThermometerHealth *health = &tracker->metrics;
+    u32 state = THERMOMETER_HEALTH_OK;
+    u64 deviation;
+    s64 difference;
+
+    // ppm share of timeouts, averaged over the same window as the short term charge time
+    tracker->timeout_ewma -= tracker->timeout_ewma >> THERMOMETER_HEALTH_FAST_SHIFT;
+    if (timed_out)
+    {
+        tracker->timeout_ewma += 1000000U >> THERMOMETER_HEALTH_FAST_SHIFT;
+        tracker->timeout_count++;
+    }
+    else if (tracker->samples++ == 0)
+    {
+        tracker->mean = charge_time;
+        tracker->slow_mean = charge_time;
+        tracker->stuck_value = charge_time;
+        tracker->stuck_since = now;
+    }
+    else
+    {
+        // exponentially weighted mean and variance, var' = (1 - a) * (var + a * diff^2)
+        difference = (s64)(charge_time - tracker->mean);
+        tracker->mean += difference >> THERMOMETER_HEALTH_FAST_SHIFT;
+        deviation = abs(difference);
+        tracker->variance += (deviation * deviation) >> THERMOMETER_HEALTH_FAST_SHIFT;
+        tracker->variance -= tracker->variance >> THERMOMETER_HEALTH_FAST_SHIFT;
+
+        tracker->slow_mean += (s64)(charge_time - tracker->slow_mean) >> THERMOMETER_HEALTH_SLOW_SHIFT;
+
+        if (thermometer_relative_ppm(abs((s64)(charge_time - tracker->stuck_value)), tracker->stuck_value) >
+            READ_ONCE(health_stuck_ppm))
+        {
+            tracker->stuck_value = charge_time;
+            tracker->stuck_since = now;
+        }
+    }
+
+    // the baseline is taken once the short term average had time to settle
+    if (health->baseline_charge_time == 0 && tracker->samples >= THERMOMETER_HEALTH_MIN_SAMPLES)
+        health->baseline_charge_time = tracker->mean;
+
+    health->mean_charge_time = (u32)min_t(u64, tracker->mean, U32_MAX);
+    health->noise_ppm = thermometer_relative_ppm(int_sqrt64(tracker->variance), tracker->mean);
+    health->drift_ppm = thermometer_relative_ppm(abs((s64)(tracker->slow_mean - health->baseline_charge_time)),
+                                                 health->baseline_charge_time);
+    health->timeout_ppm = tracker->timeout_ewma;
+    health->stuck_duration = tracker->samples > 0 ? now - tracker->stuck_since : 0;
+
+    if (health->timeout_ppm > READ_ONCE(health_timeout_ppm))
+        state = THERMOMETER_HEALTH_FAILING;
+    else if (tracker->samples < THERMOMETER_HEALTH_MIN_SAMPLES)
+        state = THERMOMETER_HEALTH_OK;
+    else if (health->stuck_duration > (u64)READ_ONCE(health_stuck_ms) * NSEC_PER_MSEC)
+        state = THERMOMETER_HEALTH_STUCK;
+    else if (health->noise_ppm > READ_ONCE(health_noise_ppm))
+        state = THERMOMETER_HEALTH_NOISY;
+    else if (health->baseline_charge_time != 0 && health->drift_ppm > READ_ONCE(health_drift_ppm))
+        state = THERMOMETER_HEALTH_DRIFTING;
+
+    if (state == health->state)
+    {
+        device->ring.page->health = *health;
+        return false;
+    }
+
+    printk(KERN_NOTICE "HEALTH: Sensor went from %s to %s\n",
+           thermometer_health_names[health->state], thermometer_health_names[state]);
+    WRITE_ONCE(health->state, state);
+    health->transitions++;
+    device->ring.page->health = *health;
+    thermometer_flight_record(&device->flight, THERMOMETER_FLIGHT_HEALTH, device->last_sample.temperature,
+                              state, now);
+
+    return true;
+}
+
+void thermometer_health_reset_baseline(ThermometerDevice *device)
+{
+    device->health.metrics.baseline_charge_time = 0;
+    device->health.samples = 0;
+    device->ring.page->health = device->health.metrics;
+}
+
+void thermometer_health_irq_restart(ThermometerDevice *device)
+{
+    device->health.metrics.irq_restarts++;
+    device->ring.page->health = device->health.metrics;
+}
+
+void thermometer_health_save(const ThermometerDevice *device, ThermometerStateFilters *filters)
+{
+    const ThermometerHealthTracker *tracker = &device->health;
+
+    filters->health_samples = tracker->samples;
+    filters->health_mean = tracker->mean;
+    filters->health_variance = tracker->variance;
+    filters->health_slow_mean = tracker->slow_mean;
+    filters->health_baseline = tracker->metrics.baseline_charge_time;
+    filters->health_timeout_ppm = tracker->timeout_ewma;
+}
+
+void thermometer_health_restore(ThermometerDevice *device, const ThermometerStateFilters *filters, u64 now)
+{
+    ThermometerHealthTracker *tracker = &device->health;
+
+    // a calibration profile carries no statistics, the baseline is taken again after it
+    if (filters->health_samples == 0)
+    {
+        thermometer_health_reset_baseline(device);
+        return;
+    }
+
+    tracker->samples = filters->health_samples;
+    tracker->mean = filters->health_mean;
+    tracker->variance = filters->health_variance;
+    tracker->slow_mean = filters->health_slow_mean;
+    tracker->timeout_ewma = min_t(u32, filters->health_timeout_ppm, 1000000U);
+    tracker->metrics.baseline_charge_time = filters->health_baseline;
+
+    // how long the charge time has been steady is measured on the exporting boot's clock, so a
+    // stuck run starts over
+    tracker->stuck_value = tracker->mean;
+    tracker->stuck_since = now;
+    device->ring.page->health = tracker->metrics;
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_RATE_LIMIT
+void thermometer_rate_limit_init(ThermometerRateLimiter *limiter)
+{
+    hash_init(limiter->uid_buckets);
+}
+
+static void thermometer_bucket_refill(ThermometerTokenBucket *bucket, unsigned int rate,
+                                      unsigned int burst, u64 now)
+{
+    u64 capacity = div_u64(NSEC_PER_SEC, rate) * max(burst, 1U);
+
+    // a fresh bucket has last_refill == 0 and so starts out full
+    bucket->credit = min(capacity, bucket->credit + (now - bucket->last_refill));
+    bucket->last_refill = now;
+}
+
+static ThermometerTokenBucket *thermometer_uid_bucket(ThermometerRateLimiter *limiter, kuid_t uid)
+{
+    ThermometerUidBucket *entry;
+
+    hash_for_each_possible(limiter->uid_buckets, entry, node, __kuid_val(uid))
+    {
+        if (uid_eq(entry->uid, uid))
+            return &entry->bucket;
+    }
+
+    // past the cap new users are only held to the global limit
+    if (limiter->uid_bucket_count >= THERMOMETER_MAX_UID_BUCKETS)
+        return NULL;
+
+    entry = kzalloc(sizeof(ThermometerUidBucket), GFP_KERNEL);
+    if (entry == NULL)
+        return NULL;
+
+    entry->uid = uid;
+    hash_add(limiter->uid_buckets, &entry->node, __kuid_val(uid));
+    limiter->uid_bucket_count++;
+
+    return &entry->bucket;
+}
+
+bool thermometer_rate_limit_allow(ThermometerRateLimiter *limiter, kuid_t uid, u64 now)
+{
+    ThermometerTokenBucket *uid_bucket = NULL;
+    unsigned int global_rate = READ_ONCE(rate_limit);
+    unsigned int user_rate = READ_ONCE(uid_rate_limit);
+
+    if (global_rate != 0)
+    {
+        thermometer_bucket_refill(&limiter->global, global_rate, READ_ONCE(rate_burst), now);
+        if (limiter->global.credit < div_u64(NSEC_PER_SEC, global_rate))
+            goto limited;
+    }
+
+    mutex_lock(&thermometer_uid_bucket_mutex);
+
+    if (user_rate != 0)
+    {
+        uid_bucket = thermometer_uid_bucket(limiter, uid);
+        if (uid_bucket != NULL)
+        {
+            thermometer_bucket_refill(uid_bucket, user_rate, READ_ONCE(uid_rate_burst), now);
+            if (uid_bucket->credit < div_u64(NSEC_PER_SEC, user_rate))
+            {
+                container_of(uid_bucket, ThermometerUidBucket, bucket)->limited_count++;
+                goto uid_limited;
+            }
+        }
+    }
+
+    // only take the tokens once both buckets agree, so a limited user doesn't drain the global bucket
+    if (global_rate != 0)
+        limiter->global.credit -= div_u64(NSEC_PER_SEC, global_rate);
+    if (uid_bucket != NULL)
+        uid_bucket->credit -= div_u64(NSEC_PER_SEC, user_rate);
+
+    mutex_unlock(&thermometer_uid_bucket_mutex);
+
+    return true;
+
+uid_limited:
+    mutex_unlock(&thermometer_uid_bucket_mutex);
+limited:
+    limiter->limited_count++;
+    return false;
+}
+
+void thermometer_rate_limit_free(ThermometerRateLimiter *limiter)
+{
+    ThermometerUidBucket *entry;
+    struct hlist_node *tmp;
+    int bkt;
+
+    mutex_lock(&thermometer_uid_bucket_mutex);
+    hash_for_each_safe(limiter->uid_buckets, bkt, tmp, entry, node)
+    {
+        hash_del(&entry->node);
+        kfree(entry);
+    }
+    limiter->uid_bucket_count = 0;
+    mutex_unlock(&thermometer_uid_bucket_mutex);
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_FLIGHT
+int thermometer_flight_init(ThermometerFlightRecorder *recorder, phys_addr_t address, size_t size)
+{
+    ThermometerFlightHeader *header;
+    ThermometerFlightHeader *recovered;
+    ThermometerFlightRecord *records;
+    u32 capacity;
+    u32 boot = 0;
+    u32 i;
+
+    if (address == 0)
+        return 0;
+
+    if (size < sizeof(ThermometerFlightHeader) + 2 * sizeof(ThermometerFlightRecord))
+    {
+        printk(KERN_WARNING "FLIGHT: Region of %zu bytes is too small\n", size);
+        return -EINVAL;
+    }
+
+    // write combining like ramoops, so that records reach RAM without flushing caches on a reset
+    header = memremap(address, size, MEMREMAP_WC);
+    if (header == NULL)
+    {
+        printk(KERN_WARNING "FLIGHT: Can't map %pa\n", &address);
+        return -ENOMEM;
+    }
+
+    records = (ThermometerFlightRecord *)(header + 1);
+    capacity = (size - sizeof(ThermometerFlightHeader)) / sizeof(ThermometerFlightRecord);
+
+    if (header->magic == THERMOMETER_FLIGHT_MAGIC && header->version == THERMOMETER_FLIGHT_VERSION &&
+        header->capacity == capacity && header->count <= capacity && header->next < capacity)
+    {
+        boot = header->boot;
+
+        recorder->recovered_length = sizeof(ThermometerFlightHeader) +
+                                     (size_t)header->count * sizeof(ThermometerFlightRecord);
+        recorder->recovered = kvmalloc(recorder->recovered_length, GFP_KERNEL);
+        if (recorder->recovered == NULL)
+        {
+            memunmap(header);
+            return -ENOMEM;
+        }
+
+        recovered = (ThermometerFlightHeader *)recorder->recovered;
+        *recovered = *header;
+        for (i = 0; i < header->count; i++)
+        {
+            ((ThermometerFlightRecord *)(recovered + 1))[i] =
+                records[(header->next + capacity - header->count + i) % capacity];
+        }
+
+        printk(KERN_INFO "FLIGHT: Recovered %u records from boot %u\n", header->count, header->boot);
+    }
+
+    header->magic = THERMOMETER_FLIGHT_MAGIC;
+    header->version = THERMOMETER_FLIGHT_VERSION;
+    header->boot = boot + 1;
+    header->capacity = capacity;
+    header->count = 0;
+    header->next = 0;
+
+    recorder->records = records;
+    recorder->header = header;
+
+    return 0;
+}
+
+void thermometer_flight_free(ThermometerFlightRecorder *recorder)
+{
+    if (recorder->header != NULL)
+        memunmap(recorder->header);
+
+    kvfree(recorder->recovered);
+    recorder->header = NULL;
+    recorder->recovered = NULL;
+}
+
+void thermometer_flight_record(ThermometerFlightRecorder *recorder, u8 kind, int temperature, u8 detail, u64 now)
+{
+    ThermometerFlightHeader *header = recorder->header;
+    ThermometerFlightRecord record;
+    u32 next;
+
+    if (header == NULL)
+        return;
+
+    record.time_ms = (u32)div_u64(now, NSEC_PER_MSEC);
+    record.temperature = (s16)clamp(temperature, S16_MIN, S16_MAX);
+    record.kind = kind;
+    record.detail = detail;
+
+    next = header->next;
+    recorder->records[next] = record;
+
+    // the record is written before the header claims it, so a reset in between loses only it
+    wmb();
+    header->next = next + 1 == header->capacity ? 0 : next + 1;
+    if (header->count < header->capacity)
+        header->count++;
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_BUDGET
+static void thermometer_budget_update_window(ThermometerCpuBudget *budget, u64 now)
+{
+    u64 elapsed = now - budget->window_start;
+
+    if (elapsed < THERMOMETER_BUDGET_WINDOW_NS)
+        return;
+
+    budget->usage_ppm = div64_u64(budget->window_cpu * 1000000ULL, elapsed);
+    budget->window_start = now;
+    budget->window_cpu = 0;
+}
+
+bool thermometer_budget_allow(ThermometerCpuBudget *budget, u64 now)
+{
+    unsigned int ppm = READ_ONCE(cpu_budget_ppm);
+    s64 capacity;
+    u64 elapsed;
+
+    thermometer_budget_update_window(budget, now);
+
+    if (ppm == 0)
+        return true;
+
+    // positive credit is capped at one window's worth, so an idle sampler can't save up a burst
+    capacity = div_u64(THERMOMETER_BUDGET_WINDOW_NS * ppm, 1000000);
+    elapsed = min_t(u64, now - budget->last_refill, THERMOMETER_BUDGET_WINDOW_NS);
+    budget->credit = min_t(s64, capacity, budget->credit + (s64)div_u64(elapsed * ppm, 1000000));
+    budget->last_refill = now;
+
+    if (budget->credit < 0)
+    {
+        budget->skipped_count++;
+        return false;
+    }
+
+    return true;
+}
+
+void thermometer_budget_charge(ThermometerCpuBudget *budget, u64 cost, u64 now)
+{
+    // a measurement can overdraw the credit, the debt then stretches the gap to the next one
+    budget->credit -= cost;
+    budget->window_cpu += cost;
+    thermometer_budget_update_window(budget, now);
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_SAMPLER
+static void thermometer_sampler_work(struct work_struct *work)
+{
+    ThermometerDevice *device = container_of(work, ThermometerDevice, sampler.work);
+
+    u64 now = thermometer_clock(device);
+
+    mutex_lock(device->device_mutex);
+    // a skipped tick stretches the interval, aligned schedules stay on their boundaries
+    if (thermometer_budget_allow(&device->budget, now))
+        thermometer_measure(device, READ_ONCE(device->sampler.trigger), READ_ONCE(device->sampler.trigger_time));
+    else
+        thermometer_sampler_progress(device, now);
+    mutex_unlock(device->device_mutex);
+}
+
+static void thermometer_sampler_trigger(ThermometerSampler *sampler, u16 trigger, u64 trigger_time)
+{
+    // a trigger that arrives while a measurement is still pending is merged into it
+    if (work_pending(&sampler->work))
+        return;
+
+    WRITE_ONCE(sampler->trigger, trigger);
+    WRITE_ONCE(sampler->trigger_time, trigger_time);
+    queue_work(system_highpri_wq, &sampler->work);
+}
+
+static enum hrtimer_restart thermometer_sampler_timer(struct hrtimer *timer)
+{
+    ThermometerSampler *sampler = container_of(timer, ThermometerSampler, timer);
+    ktime_t interval = ms_to_ktime(sample_interval_ms);
+    // the timer may run late, so the trigger time is the expiry translated to the monotonic clock
+    s64 lateness = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(timer), hrtimer_get_expires(timer)));
+    u16 trigger = sample_mode == THERMOMETER_MODE_ALIGNED ? THERMOMETER_TRIGGER_ALIGNED
+                                                          : THERMOMETER_TRIGGER_PERIODIC;
+
+    thermometer_sampler_trigger(sampler, trigger, ktime_get_mono_fast_ns() - max_t(s64, lateness, 0));
+
+    // forwarding from the expiry rather than from now keeps aligned timers on their boundaries
+    hrtimer_forward(timer, hrtimer_cb_get_time(timer), interval);
+
+    return HRTIMER_RESTART;
+}
+
+static irqreturn_t thermometer_trigger_irq(int irq, void *data)
+{
+    ThermometerSampler *sampler = (ThermometerSampler *)data;
+
+    thermometer_sampler_trigger(sampler, THERMOMETER_TRIGGER_EXTERNAL, ktime_get_mono_fast_ns());
+
+    return IRQ_HANDLED;
+}
+
+int thermometer_sampler_start(ThermometerDevice *device)
+{
+    ThermometerSampler *sampler = &device->sampler;
+    u64 interval_ns = (u64)sample_interval_ms * NSEC_PER_MSEC;
+    u64 now;
+    int result;
+
+    INIT_WORK(&sampler->work, thermometer_sampler_work);
+    sampler->trigger_irq = -1;
+
+    switch (sample_mode)
+    {
+    case THERMOMETER_MODE_OPEN:
+        return 0;
+
+    case THERMOMETER_MODE_PERIODIC:
+    case THERMOMETER_MODE_ALIGNED:
+        if (sample_interval_ms == 0)
+        {
+            printk(KERN_WARNING "SAMPLER: sample_interval_ms must be positive\n");
+            return -EINVAL;
+        }
+
+        if (thermometer_simulated(device))
+        {
+            // fast-forwarding runs the ticks, a timer would fire on the real clock
+            now = thermometer_clock(device);
+            device->simulation.next_tick = (div64_u64(now, interval_ns) + 1) * interval_ns;
+        }
+        else if (sample_mode == THERMOMETER_MODE_PERIODIC)
+        {
+            hrtimer_init(&sampler->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+            sampler->timer.function = thermometer_sampler_timer;
+            hrtimer_start(&sampler->timer, ns_to_ktime(interval_ns), HRTIMER_MODE_REL);
+        }
+        else
+        {
+            // the next multiple of the interval since the epoch, e.g. the top of the next second
+            now = ktime_get_real_ns();
+            hrtimer_init(&sampler->timer, CLOCK_REALTIME, HRTIMER_MODE_ABS);
+            sampler->timer.function = thermometer_sampler_timer;
+            hrtimer_start(&sampler->timer, ns_to_ktime((div64_u64(now, interval_ns) + 1) * interval_ns),
+                          HRTIMER_MODE_ABS);
+        }
+        break;
+
+    case THERMOMETER_MODE_EXTERNAL:
+        if (trigger_gpio < 0)
+        {
+            printk(KERN_WARNING "SAMPLER: trigger_gpio is required in the external mode\n");
+            return -EINVAL;
+        }
+
+        result = gpio_request_one(GPIO_OFFSET + trigger_gpio, GPIOF_DIR_IN, "TRIGGER_PIN");
+        if (result != 0)
+        {
+            printk(KERN_WARNING "SAMPLER: Trigger pin config failed: %pe\n", ERR_PTR(result));
+            return result;
+        }
+
+        sampler->trigger_irq = gpio_to_irq(GPIO_OFFSET + trigger_gpio);
+        if (sampler->trigger_irq < 0)
+        {
+            result = sampler->trigger_irq;
+            goto trigger_irq_failed;
+        }
+
+        result = request_irq(sampler->trigger_irq, thermometer_trigger_irq, IRQF_TRIGGER_RISING,
+                             "thermometer-trigger", sampler);
+        if (result != 0)
+            goto trigger_irq_failed;
+        break;
+
+    default:
+        printk(KERN_WARNING "SAMPLER: Unknown sample_mode %u\n", sample_mode);
+        return -EINVAL;
+    }
+
+    sampler->running = true;
+    return 0;
+
+trigger_irq_failed:
+    printk(KERN_WARNING "SAMPLER: Trigger IRQ setup failed: %pe\n", ERR_PTR(result));
+    sampler->trigger_irq = -1;
+    gpio_free(GPIO_OFFSET + trigger_gpio);
+    return result;
+}
+
+void thermometer_sampler_stop(ThermometerDevice *device)
+{
+    ThermometerSampler *sampler = &device->sampler;
+
+    if (!sampler->running)
+        return;
+
+    if (sample_mode == THERMOMETER_MODE_EXTERNAL)
+    {
+        free_irq(sampler->trigger_irq, sampler);
+        gpio_free(GPIO_OFFSET + trigger_gpio);
+    }
+    else if (!thermometer_simulated(device))
+    {
+        hrtimer_cancel(&sampler->timer);
+    }
+
+    cancel_work_sync(&sampler->work);
+    sampler->running = false;
+}
+
+/// @brief Restarts the sampler if it hasn't made progress for watchdog_intervals
+/// @return false if the restart failed and the sampler is stopped
+static bool thermometer_watchdog_check(ThermometerDevice *device, u64 now)
+{
+    ThermometerSampler *sampler = &device->sampler;
+    unsigned int intervals = READ_ONCE(watchdog_intervals);
+    u64 interval_ns = (u64)sample_interval_ms * NSEC_PER_MSEC;
+    int result;
+
+    // external triggers come whenever they come, there is no interval to miss
+    if (sample_mode == THERMOMETER_MODE_EXTERNAL)
+        return true;
+
+    if (intervals == 0 || now - READ_ONCE(sampler->last_progress) <= intervals * interval_ns)
+        return true;
+
+    printk(KERN_WARNING "WATCHDOG: No sample for %u intervals, restarting the sampler\n", intervals);
+
+    // the sampler's work takes the mutex, so it has to be stopped before taking it here
+    thermometer_sampler_stop(device);
+
+    mutex_lock(device->device_mutex);
+    thermometer_ring_set_stale(&device->ring, true);
+    gpio_direction_output(OUTPUT_PIN, 0);
+    gpio_direction_input(INPUT_PIN);
+
+    // a lost edge IRQ stalls every charge in edge mode, so the IRQ is re-requested as well
+    if (thermometer_edge_active(&device->edge))
+    {
+        thermometer_edge_free(&device->edge);
+        result = thermometer_edge_init(&device->edge);
+        if (result != 0)
+            printk(KERN_ERR "WATCHDOG: Edge IRQ re-request failed, polling the charges: %pe\n",
+                   ERR_PTR(result));
+        thermometer_health_irq_restart(device);
+    }
+
+    sampler->last_progress = now;
+    sampler->recoveries++;
+    mutex_unlock(device->device_mutex);
+
+    result = thermometer_sampler_start(device);
+    if (result != 0)
+    {
+        printk(KERN_ERR "WATCHDOG: Sampler restart failed: %pe\n", ERR_PTR(result));
+        return false;
+    }
+
+    return true;
+}
+
+static void thermometer_watchdog_work(struct work_struct *work)
+{
+    ThermometerDevice *device = container_of(to_delayed_work(work), ThermometerDevice, sampler.watchdog);
+
+    if (thermometer_watchdog_check(device, thermometer_clock(device)))
+        queue_delayed_work(system_wq, &device->sampler.watchdog, msecs_to_jiffies(sample_interval_ms));
+}
+
+void thermometer_watchdog_start(ThermometerDevice *device)
+{
+    ThermometerSampler *sampler = &device->sampler;
+
+    INIT_DELAYED_WORK(&sampler->watchdog, thermometer_watchdog_work);
+
+    // without a sampler nothing is expected to publish samples, and external triggers have no
+    // interval a missing sample could be measured against
+    if (!sampler->running || sample_mode == THERMOMETER_MODE_EXTERNAL)
+        return;
+
+    sampler->last_progress = thermometer_clock(device);
+
+    // fast-forwarding checks on the virtual clock after every tick
+    if (!thermometer_simulated(device))
+        queue_delayed_work(system_wq, &sampler->watchdog, msecs_to_jiffies(sample_interval_ms));
+}
+
+void thermometer_watchdog_stop(ThermometerDevice *device)
+{
+    cancel_delayed_work_sync(&device->sampler.watchdog);
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_SIMULATE
+static DEFINE_MUTEX(thermometer_simulation_mutex);
+
+void thermometer_simulation_init(ThermometerSimulation *simulation)
+{
+    simulation->active = simulate;
+    simulation->now = ktime_get_mono_fast_ns();
+    simulation->seed = get_random_u32() | 1U;
+}
+
+int thermometer_simulation_charge(ThermometerDevice *device, u64 *start, u64 *end, u64 *slept)
+{
+    ThermometerSimulation *simulation = &device->simulation;
+    u64 period = max_t(u64, (u64)READ_ONCE(simulate_period_s) * NSEC_PER_SEC, 2);
+    u64 swing = (u64)READ_ONCE(simulate_swing_us) * NSEC_PER_USEC;
+    u32 noise = READ_ONCE(simulate_noise_ns);
+    u64 timeout = (u64)READ_ONCE(charge_timeout_ms) * NSEC_PER_MSEC;
+    u64 phase;
+    u64 rise;
+    s64 charge_time;
+    u32 random;
+
+    // a triangle wave over the period, from the mean minus the swing up to the mean plus it
+    div64_u64_rem(simulation->now, period, &phase);
+    rise = phase < period / 2 ? phase : period - phase;
+    charge_time = (s64)READ_ONCE(simulate_charge_us) * NSEC_PER_USEC - (s64)swing +
+                  (s64)mul_u64_u64_div_u64(2 * swing, rise, period / 2);
+
+    // xorshift32, reproducible and cheap enough to run for every virtual sample
+    random = simulation->seed;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    simulation->seed = random;
+    if (noise != 0)
+        charge_time += (s64)(random % (2ULL * noise + 1)) - noise;
+
+    charge_time = max_t(s64, charge_time, 1);
+
+    *start = simulation->now;
+    if ((u64)charge_time > timeout)
+    {
+        WRITE_ONCE(simulation->now, *start + timeout);
+        *slept = timeout;
+        return -ETIMEDOUT;
+    }
+
+    WRITE_ONCE(simulation->now, *start + charge_time);
+    *end = simulation->now;
+    *slept = charge_time;
+
+    return 0;
+}
+
+int thermometer_simulation_advance(ThermometerDevice *device, u64 duration)
+{
+    ThermometerSimulation *simulation = &device->simulation;
+    ThermometerSampler *sampler = &device->sampler;
+    u64 interval_ns = (u64)sample_interval_ms * NSEC_PER_MSEC;
+    u16 trigger = sample_mode == THERMOMETER_MODE_ALIGNED ? THERMOMETER_TRIGGER_ALIGNED
+                                                          : THERMOMETER_TRIGGER_PERIODIC;
+    bool ticking = sample_mode == THERMOMETER_MODE_PERIODIC || sample_mode == THERMOMETER_MODE_ALIGNED;
+    int result = 0;
+    u64 target;
+    u64 tick;
+    u64 now;
+
+    // also refuses writes on the insmod line, which come before the simulation is set up
+    if (!simulation->active)
+        return -EINVAL;
+
+    mutex_lock(&thermometer_simulation_mutex);
+    now = thermometer_simulation_now(device);
+    // a wrapped target would lie in the past and the clock wouldn't move at all
+    if (duration > U64_MAX - now)
+    {
+        mutex_unlock(&thermometer_simulation_mutex);
+        return -EOVERFLOW;
+    }
+    target = now + duration;
+
+    // the external mode has no ticks to run and the open mode no sampler, time just moves on
+    while (ticking && READ_ONCE(sampler->running) && simulation->next_tick <= target)
+    {
+        mutex_lock(device->device_mutex);
+        tick = simulation->next_tick;
+        WRITE_ONCE(simulation->now, max(simulation->now, tick));
+        now = simulation->now;
+
+        if (thermometer_budget_allow(&device->budget, now))
+            thermometer_measure(device, trigger, tick);
+        else
+            thermometer_sampler_progress(device, now);
+
+        // like hrtimer_forward, ticks that passed during the measurement are skipped
+        now = simulation->now;
+        simulation->next_tick = tick + interval_ns * (div64_u64(now - tick, interval_ns) + 1);
+        simulation->ticks++;
+        mutex_unlock(device->device_mutex);
+
+        thermometer_watchdog_check(device, now);
+
+        if (fatal_signal_pending(current))
+        {
+            result = -EINTR;
+            break;
+        }
+        cond_resched();
+    }
+
+    if (result == 0)
+    {
+        mutex_lock(device->device_mutex);
+        WRITE_ONCE(simulation->now, max(simulation->now, target));
+        mutex_unlock(device->device_mutex);
+    }
+
+    mutex_unlock(&thermometer_simulation_mutex);
+
+    return result;
+}
+#endif
+
+int thermometer_open(struct inode *inode, struct file *filp)
+{
+    ThermometerDevice *device;
+    int return_val = 0;
+    u64 now;
+
+    printk(KERN_INFO "Opened\n");
+
+    device = container_of(inode->i_cdev, ThermometerDevice, cdev);
+    filp->private_data = device;
+
+    if (mutex_lock_interruptible(device->device_mutex) != 0)
+    {
+        printk(KERN_WARNING "OPEN: Failed to lock mutex\n");
+        return_val = -ERESTARTSYS;
+        goto device_mutex_lock_failed;
+    }
+
+    // when limited, or when the sampler keeps the cache fresh, the reader gets the last sample
+    now = thermometer_clock(device);
+    if (!thermometer_sampler_running(device) &&
+        thermometer_budget_allow(&device->budget, now) &&
+        thermometer_rate_limit_allow(&device->rate_limiter, current_uid(), now))
+        thermometer_measure(device, THERMOMETER_TRIGGER_OPEN, now);
+    else
+        thermometer_nowcast_format(device, now);
+
+    mutex_unlock(device->device_mutex);
+
+device_mutex_lock_failed:
+    return return_val;
+}
+
+int thermometer_release(struct inode *inode, struct file *filp)
+{
+    printk(KERN_INFO "Closing\n");
+
+    return 0;
+}
+
+ssize_t thermometer_read(struct file *filp, char __user *buf, size_t count,
+                         loff_t *f_pos)
+{
+    size_t str_len = 0;
+    size_t copy_len = 0;
+    ThermometerDevice *device;
+    ssize_t return_val = 0;
+
+    printk(KERN_INFO "Reading\n");
+
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+    {
+        printk(KERN_WARNING "READ: Missing read permissions\n");
+        return_val = -EPERM;
+        goto insufficient_permissions;
+    }
+
+    device = (ThermometerDevice *)filp->private_data;
+    if (mutex_lock_interruptible(device->device_mutex) != 0)
+    {
+        printk(KERN_WARNING "READ: Failed to lock mutex\n");
+        return_val = -ERESTARTSYS;
+        goto device_mutex_lock_failed;
+    }
+
+    // open doesn't measure with a sampler running, so there may be nothing to return yet, and a
+    // timed out measurement leaves nothing valid either
+    if (device->temperature[0] == '\0')
+    {
+        return_val = -ENODATA;
+        goto close_function;
+    }
+
+    str_len = strnlen(device->temperature, TEMPERATURE_LENGTH);
+    if (*f_pos >= str_len)
+    {
+        printk(KERN_WARNING "READ: Can't read past EOF\n");
+        goto close_function;
+    }
+
+    copy_len = count <= (str_len - *f_pos) ? count : (str_len - *f_pos);
+
+    copy_len -= copy_to_user(buf, device->temperature + *f_pos, copy_len);
+    *f_pos += copy_len;
+    return_val = copy_len;
+
+close_function:
+    mutex_unlock(device->device_mutex);
+device_mutex_lock_failed:
+insufficient_permissions:
+    return return_val;
+}
+
+#ifdef CONFIG_THERMOMETER_RING
+int thermometer_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    ThermometerDevice *device = (ThermometerDevice *)filp->private_data;
+    unsigned long length = vma->vm_end - vma->vm_start;
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+
+    // the consumer's tail is the only page user space may write
+    if (offset == device->ring.size && length == PAGE_SIZE)
+        return remap_vmalloc_range(vma, device->ring.tail, 0);
+
+    // the control page alone tells readers how large the whole mapping is
+    if (offset != 0 || (length != device->ring.size && length != PAGE_SIZE))
+    {
+        printk(KERN_WARNING "MMAP: Mapping must cover the control page or the whole ring (%lu bytes)\n",
+               device->ring.size);
+        return -EINVAL;
+    }
+
+    if (vma->vm_flags & VM_WRITE)
+    {
+        printk(KERN_WARNING "MMAP: The ring can only be mapped read only\n");
+        return -EPERM;
+    }
+    vm_flags_clear(vma, VM_MAYWRITE);
+
+    return remap_vmalloc_range(vma, device->ring.page, 0);
+}
+
+__poll_t thermometer_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    ThermometerDevice *device = (ThermometerDevice *)filp->private_data;
+
+    poll_wait(filp, &device->ring.wait, wait);
+
+    if (READ_ONCE(device->ring.head) != READ_ONCE(device->ring.tail->data_tail))
+        return EPOLLIN | EPOLLRDNORM;
 
-int thermometer_major = 0; // use dynamic major
-int thermometer_minor = 0;
+    return 0;
+}
+#endif
 
-#define GPIO_OFFSET 512U
-#define INPUT_PIN (GPIO_OFFSET + 18U)  // GPIO 18
-#define OUTPUT_PIN (GPIO_OFFSET + 23U) // GPIO 23
-#define TEMPERATURE_LENGTH 30U
+long thermometer_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    ThermometerDevice *device = (ThermometerDevice *)filp->private_data;
+#ifdef CONFIG_THERMOMETER_SIMULATE
+    u64 ms;
 
-#ifdef __KERNEL__
-MODULE_AUTHOR("Sean Sweet");
-MODULE_LICENSE("Dual BSD/GPL");
+    // fast-forwarding can take a while, so it runs here rather than in a parameter's setter, which
+    // would hold the lock of all the module's parameters meanwhile
+    if (cmd == THERMOMETER_IOC_SIMULATE_ADVANCE)
+    {
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (get_user(ms, (__u64 __user *)arg) != 0)
+            return -EFAULT;
+        if (ms > div_u64(U64_MAX, NSEC_PER_MSEC))
+            return -EINVAL;
+
+        return thermometer_simulation_advance(device, ms * NSEC_PER_MSEC);
+    }
 #endif
 
-ThermometerDevice thermometer_device = {0};
+    return thermometer_ring_ioctl(device, cmd, arg, NULL);
+}
+
+struct file_operations thermometer_fops = {
+    .owner = THIS_MODULE,
+    .read = thermometer_read,
+    .open = thermometer_open,
+    .release = thermometer_release,
+#ifdef CONFIG_THERMOMETER_RING
+    .mmap = thermometer_mmap,
+    .poll = thermometer_poll,
+#endif
+    .unlocked_ioctl = thermometer_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
 
-int time_to_resistance(u64 time_elapsed)
+#ifdef CONFIG_THERMOMETER_STATE
+int thermometer_state_export(ThermometerDevice *device, ThermometerStateFile *state)
 {
-    return div64_long(time_elapsed, 50000) + 8000;
+    ThermometerRing *ring = &device->ring;
+    ThermometerStateHeader *header;
+    ThermometerSample *samples;
+    u64 head = ring->head;
+    u32 count = min_t(u64, head, ring->capacity);
+    u32 i;
+
+    state->size = sizeof(ThermometerStateHeader) + (size_t)ring->capacity * sizeof(ThermometerSample);
+    state->data = kvzalloc(state->size, GFP_KERNEL);
+    if (state->data == NULL)
+        return -ENOMEM;
+
+    header = (ThermometerStateHeader *)state->data;
+    samples = (ThermometerSample *)(header + 1);
+
+    header->magic = THERMOMETER_STATE_MAGIC;
+    header->version = THERMOMETER_STATE_VERSION;
+    header->sample_count = count;
+    header->calibration = device->calibration;
+    header->last_sample = device->last_sample;
+    thermometer_health_save(device, &header->filters);
+    thermometer_nowcast_save(&device->nowcast, &header->filters);
+
+    for (i = 0; i < count; i++)
+        samples[i] = ring->samples[(head - count + i) & (ring->capacity - 1)];
+
+    state->length = sizeof(ThermometerStateHeader) + (size_t)count * sizeof(ThermometerSample);
+    header->size = state->length;
+
+    return 0;
 }
 
-int resistance_to_temperature(int resistance)
+int thermometer_state_import(ThermometerDevice *device, const char *data, size_t length)
 {
-    // the ratio between the current resistance, and the resistance at 25C, times 1000
-    int relative_resistance = resistance / 10;
+    const ThermometerStateHeader *header = (const ThermometerStateHeader *)data;
+    const ThermometerSample *samples = (const ThermometerSample *)(header + 1);
+    u64 now;
+    u32 i;
+
+    if (length < sizeof(ThermometerStateHeader) || header->magic != THERMOMETER_STATE_MAGIC)
+    {
+        printk(KERN_WARNING "STATE: Not a thermometer state blob\n");
+        return -EINVAL;
+    }
+
+    if (header->version != THERMOMETER_STATE_VERSION)
+    {
+        printk(KERN_WARNING "STATE: Unsupported state version %u\n", header->version);
+        return -EINVAL;
+    }
+
+    if (header->size != length ||
+        header->sample_count > (length - sizeof(ThermometerStateHeader)) / sizeof(ThermometerSample))
+    {
+        printk(KERN_WARNING "STATE: Truncated state blob\n");
+        return -EINVAL;
+    }
+
+    if (header->calibration.time_divisor == 0 || header->calibration.scale == 0)
+    {
+        printk(KERN_WARNING "STATE: Invalid calibration\n");
+        return -EINVAL;
+    }
+
+    device->calibration = header->calibration;
+    now = thermometer_clock(device);
+    thermometer_health_restore(device, &header->filters, now);
+    thermometer_nowcast_restore(&device->nowcast, &header->filters, now);
+
+    // a calibration profile carries no samples and leaves the cached one alone
+    if (header->sample_count != 0 || header->last_sample.timestamp != 0)
+    {
+        device->last_sample = header->last_sample;
+        snprintf(device->temperature, TEMPERATURE_LENGTH, "%d\n", header->last_sample.temperature);
+    }
+
+    // samples older than the ring's capacity would be overwritten straight away
+    i = header->sample_count > device->ring.capacity ? header->sample_count - device->ring.capacity : 0;
+    for (; i < header->sample_count; i++)
+        thermometer_ring_publish(&device->ring, &samples[i]);
+    if (header->sample_count != 0)
+        thermometer_ring_mark_imported(&device->ring);
+
+    printk(KERN_INFO "STATE: Imported %u samples\n", header->sample_count);
 
-    return (relative_resistance * -18 + 55685) / 463;
+    return 0;
 }
 
-int thermometer_open(struct inode *inode, struct file *filp)
+int thermometer_state_open(struct inode *inode, struct file *filp)
 {
     ThermometerDevice *device;
+    ThermometerStateFile *state;
     int return_val = 0;
-    int resistance = 0;
-    int temperature = 0;
 
-    printk(KERN_INFO "Opened\n");
+    device = container_of(inode->i_cdev, ThermometerDevice, state_cdev);
 
-    device = container_of(inode->i_cdev, ThermometerDevice, cdev);
-    filp->private_data = device;
+    state = kzalloc(sizeof(ThermometerStateFile), GFP_KERNEL);
+    if (state == NULL)
+    {
+        printk(KERN_WARNING "STATE: State file malloc failed\n");
+        return_val = -ENOMEM;
+        goto state_malloc_failed;
+    }
 
     if (mutex_lock_interruptible(device->device_mutex) != 0)
     {
-        printk(KERN_WARNING "OPEN: Failed to lock mutex\n");
+        printk(KERN_WARNING "STATE: Failed to lock mutex\n");
         return_val = -ERESTARTSYS;
         goto device_mutex_lock_failed;
     }
 
-    gpio_set_value(OUTPUT_PIN, 0);
+    // the buffer sized for a full ring doubles as the write buffer for an import
+    return_val = thermometer_state_export(device, state);
+    mutex_unlock(device->device_mutex);
+    if (return_val != 0)
+        goto device_mutex_lock_failed;
+
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+        state->length = 0;
 
-    msleep(5);
+    filp->private_data = state;
 
-    u64 start = ktime_get_mono_fast_ns();
-    gpio_set_value(OUTPUT_PIN, 1);
-    while (gpio_get_value(INPUT_PIN) != 1)
-        ;
+    return 0;
 
-    u64 end = ktime_get_mono_fast_ns();
-    resistance = time_to_resistance(end - start);
-    temperature = resistance_to_temperature(resistance);
+device_mutex_lock_failed:
+    kfree(state);
+state_malloc_failed:
+    return return_val;
+}
 
-    snprintf(device->temperature, TEMPERATURE_LENGTH, "%d\n", temperature);
+int thermometer_state_flush(struct file *filp, fl_owner_t id)
+{
+    ThermometerDevice *device = container_of(file_inode(filp)->i_cdev, ThermometerDevice,
+                                             state_cdev);
+    ThermometerStateFile *state = (ThermometerStateFile *)filp->private_data;
+    int return_val = 0;
 
-    gpio_set_value(OUTPUT_PIN, 0);
+    if (!state->written)
+        return 0;
 
+    // flush's return reaches close(2), release's doesn't
+    if (mutex_lock_interruptible(device->device_mutex) != 0)
+        return -ERESTARTSYS;
+    return_val = thermometer_state_import(device, state->data, state->length);
     mutex_unlock(device->device_mutex);
 
-device_mutex_lock_failed:
+    // import once, a dup'd descriptor closing later mustn't load the blob again
+    state->written = false;
+    state->length = 0;
+
     return return_val;
 }
 
-int thermometer_release(struct inode *inode, struct file *filp)
+int thermometer_state_release(struct inode *inode, struct file *filp)
 {
-    printk(KERN_INFO "Closing\n");
+    ThermometerStateFile *state = (ThermometerStateFile *)filp->private_data;
+
+    kvfree(state->data);
+    kfree(state);
 
     return 0;
 }
 
-ssize_t thermometer_read(struct file *filp, char __user *buf, size_t count,
-                         loff_t *f_pos)
+ssize_t thermometer_state_read(struct file *filp, char __user *buf, size_t count,
+                               loff_t *f_pos)
 {
-    size_t str_len = 0;
-    size_t copy_len = 0;
-    ThermometerDevice *device;
-    ssize_t return_val;
+    ThermometerStateFile *state = (ThermometerStateFile *)filp->private_data;
 
-    printk(KERN_INFO "Reading\n");
+    if (state->written)
+        return -EBUSY;
 
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+    return simple_read_from_buffer(buf, count, f_pos, state->data, state->length);
+}
+
+ssize_t thermometer_state_write(struct file *filp, const char __user *buf, size_t count,
+                                loff_t *f_pos)
+{
+    ThermometerStateFile *state = (ThermometerStateFile *)filp->private_data;
+    ssize_t written;
+
+    if (*f_pos >= state->size)
     {
-        printk(KERN_WARNING "READ: Missing read permissions\n");
-        return_val = -EPERM;
-        goto insufficient_permissions;
+        printk(KERN_WARNING "STATE: Blob larger than the sample ring\n");
+        return -EFBIG;
     }
 
-    device = (ThermometerDevice *)filp->private_data;
-    if (mutex_lock_interruptible(device->device_mutex) != 0)
+    written = simple_write_to_buffer(state->data, state->size, f_pos, buf, count);
+    if (written > 0)
     {
-        printk(KERN_WARNING "READ: Failed to lock mutex\n");
-        return_val = -ERESTARTSYS;
-        goto device_mutex_lock_failed;
+        state->written = true;
+        state->length = max_t(size_t, state->length, *f_pos);
     }
 
-    str_len = strnlen(device->temperature, TEMPERATURE_LENGTH);
-    if (*f_pos >= str_len)
+    return written;
+}
+
+struct file_operations thermometer_state_fops = {
+    .owner = THIS_MODULE,
+    .read = thermometer_state_read,
+    .write = thermometer_state_write,
+    .open = thermometer_state_open,
+    .flush = thermometer_state_flush,
+    .release = thermometer_state_release,
+};
+#endif
+
+#ifdef CONFIG_THERMOMETER_FLIGHT
+int thermometer_flight_open(struct inode *inode, struct file *filp)
+{
+    filp->private_data = container_of(inode->i_cdev, ThermometerDevice, flight_cdev);
+
+    return 0;
+}
+
+ssize_t thermometer_flight_read(struct file *filp, char __user *buf, size_t count,
+                                loff_t *f_pos)
+{
+    ThermometerDevice *device = (ThermometerDevice *)filp->private_data;
+
+    // the recovered trace never changes after load, so no locking is needed
+    return simple_read_from_buffer(buf, count, f_pos, device->flight.recovered,
+                                   device->flight.recovered_length);
+}
+
+struct file_operations thermometer_flight_fops = {
+    .owner = THIS_MODULE,
+    .read = thermometer_flight_read,
+    .open = thermometer_flight_open,
+};
+#endif
+
+#ifdef CONFIG_THERMOMETER_STREAM
+int thermometer_stream_open(struct inode *inode, struct file *filp)
+{
+    ThermometerDevice *device = container_of(inode->i_cdev, ThermometerDevice, stream_cdev);
+    ThermometerStream *stream;
+
+    stream = kzalloc(sizeof(ThermometerStream), GFP_KERNEL);
+    if (stream == NULL)
     {
-        printk(KERN_WARNING "READ: Can't read past EOF\n");
-        goto close_function;
+        printk(KERN_WARNING "STREAM: Stream malloc failed\n");
+        return -ENOMEM;
     }
 
-    copy_len = count <= (str_len - *f_pos) ? count : (str_len - *f_pos);
+    stream->device = device;
+    stream->cursor = READ_ONCE(device->ring.head);
+    filp->private_data = stream;
 
-    copy_len -= copy_to_user(buf, device->temperature + *f_pos, copy_len);
-    *f_pos += copy_len;
+    return stream_open(inode, filp);
+}
+
+int thermometer_stream_release(struct inode *inode, struct file *filp)
+{
+    kfree(filp->private_data);
+
+    return 0;
+}
+
+static bool thermometer_stream_ready(ThermometerStream *stream)
+{
+    ThermometerRing *ring = &stream->device->ring;
+
+    return stream->offset != stream->length ||
+           READ_ONCE(ring->head) != max(stream->cursor, READ_ONCE(ring->import_end));
+}
+
+ssize_t thermometer_stream_read(struct file *filp, char __user *buf, size_t count,
+                                loff_t *f_pos)
+{
+    ThermometerStream *stream = (ThermometerStream *)filp->private_data;
+    ThermometerDevice *device = stream->device;
+    ThermometerRing *ring = &device->ring;
+    ThermometerSample sample;
+    size_t copy_len;
+    u64 head;
+
+    while (stream->offset == stream->length)
+    {
+        if ((filp->f_flags & O_NONBLOCK) == 0 &&
+            wait_event_interruptible(ring->wait, thermometer_stream_ready(stream)) != 0)
+            return -ERESTARTSYS;
+
+        if (mutex_lock_interruptible(device->device_mutex) != 0)
+            return -ERESTARTSYS;
+
+        // samples imported from an earlier boot were never live, so open readers skip them
+        stream->cursor = max(stream->cursor, ring->import_end);
+        head = ring->head;
+        if (head == stream->cursor)
+        {
+            mutex_unlock(device->device_mutex);
+            if (filp->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            continue;
+        }
+
+        // a reader that fell more than a ring behind skips the samples that were overwritten
+        if (head - stream->cursor > ring->capacity)
+            stream->cursor = head - ring->capacity;
+
+        sample = ring->samples[stream->cursor & (ring->capacity - 1)];
+        stream->cursor++;
+        mutex_unlock(device->device_mutex);
+
+        if (sample.flags & THERMOMETER_SAMPLE_RAW)
+            stream->length = scnprintf(stream->line, THERMOMETER_STREAM_LINE_LENGTH, "%llu %u\n",
+                                       sample.timestamp, sample.charge_time);
+        else
+            stream->length = scnprintf(stream->line, THERMOMETER_STREAM_LINE_LENGTH, "%llu %d\n",
+                                       sample.timestamp, sample.temperature);
+        stream->offset = 0;
+    }
+
+    copy_len = min(count, stream->length - stream->offset);
+    if (copy_to_user(buf, stream->line + stream->offset, copy_len) != 0)
+        return -EFAULT;
+
+    stream->offset += copy_len;
 
-close_function:
-    mutex_unlock(device->device_mutex);
-device_mutex_lock_failed:
-insufficient_permissions:
     return copy_len;
 }
 
-struct file_operations thermometer_fops = {
+__poll_t thermometer_stream_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    ThermometerStream *stream = (ThermometerStream *)filp->private_data;
+
+    poll_wait(filp, &stream->device->ring.wait, wait);
+
+    return thermometer_stream_ready(stream) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+long thermometer_stream_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    ThermometerStream *stream = (ThermometerStream *)filp->private_data;
+    u64 sequence;
+    long result;
+
+    result = thermometer_ring_ioctl(stream->device, cmd, arg, &sequence);
+    if (result == 0 && cmd == THERMOMETER_IOC_FIND)
+    {
+        stream->cursor = sequence;
+        stream->offset = stream->length;
+    }
+
+    return result;
+}
+
+struct file_operations thermometer_stream_fops = {
     .owner = THIS_MODULE,
-    .read = thermometer_read,
-    .open = thermometer_open,
-    .release = thermometer_release,
+    .read = thermometer_stream_read,
+    .open = thermometer_stream_open,
+    .release = thermometer_stream_release,
+    .poll = thermometer_stream_poll,
+    .unlocked_ioctl = thermometer_stream_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
+#endif
 
 static int thermometer_setup_cdev(ThermometerDevice *dev)
 {
@@ -160,11 +2518,88 @@ static int thermometer_setup_cdev(ThermometerDevice *dev)
     return err;
 }
 
+#ifdef CONFIG_THERMOMETER_STATE
+static int thermometer_setup_state_cdev(ThermometerDevice *dev)
+{
+    int err, devno = MKDEV(thermometer_major, thermometer_minor + 1);
+
+    cdev_init(&dev->state_cdev, &thermometer_state_fops);
+    dev->state_cdev.owner = THIS_MODULE;
+    dev->state_cdev.ops = &thermometer_state_fops;
+    err = cdev_add(&dev->state_cdev, devno, 1);
+    if (err)
+    {
+        printk(KERN_ERR "Error %d adding thermometer state cdev\n", err);
+    }
+    return err;
+}
+#else
+static int thermometer_setup_state_cdev(ThermometerDevice *dev)
+{
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_FLIGHT
+static int thermometer_setup_flight_cdev(ThermometerDevice *dev)
+{
+    int err, devno = MKDEV(thermometer_major, thermometer_minor + 2);
+
+    cdev_init(&dev->flight_cdev, &thermometer_flight_fops);
+    dev->flight_cdev.owner = THIS_MODULE;
+    dev->flight_cdev.ops = &thermometer_flight_fops;
+    err = cdev_add(&dev->flight_cdev, devno, 1);
+    if (err)
+    {
+        printk(KERN_ERR "Error %d adding thermometer flight recorder cdev\n", err);
+    }
+    return err;
+}
+#else
+static int thermometer_setup_flight_cdev(ThermometerDevice *dev)
+{
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_THERMOMETER_STREAM
+static int thermometer_setup_stream_cdev(ThermometerDevice *dev)
+{
+    int err, devno = MKDEV(thermometer_major, thermometer_minor + 3);
+
+    cdev_init(&dev->stream_cdev, &thermometer_stream_fops);
+    dev->stream_cdev.owner = THIS_MODULE;
+    dev->stream_cdev.ops = &thermometer_stream_fops;
+    err = cdev_add(&dev->stream_cdev, devno, 1);
+    if (err)
+    {
+        printk(KERN_ERR "Error %d adding thermometer stream cdev\n", err);
+    }
+    return err;
+}
+#else
+static int thermometer_setup_stream_cdev(ThermometerDevice *dev)
+{
+    return 0;
+}
+#endif
+
 int thermometer_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, thermometer_minor, 1,
+
+    if (charge_mode > THERMOMETER_CHARGE_HYBRID
+#ifndef CONFIG_THERMOMETER_EDGE_IRQ
+        || charge_mode == THERMOMETER_CHARGE_EDGE
+#endif
+    )
+    {
+        printk(KERN_WARNING "INIT: Unsupported charge_mode %u\n", charge_mode);
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, thermometer_minor, THERMOMETER_MINOR_COUNT,
                                  "thermometer");
     thermometer_major = MAJOR(dev);
     if (result < 0)
@@ -173,7 +2608,8 @@ int thermometer_init_module(void)
         goto alloc_chrdev_failed;
     }
 
-    thermometer_device.temperature = kmalloc_array(TEMPERATURE_LENGTH, sizeof(char), GFP_KERNEL);
+    // an empty buffer reads as -ENODATA until the first sample
+    thermometer_device.temperature = kzalloc(TEMPERATURE_LENGTH, GFP_KERNEL);
     if (thermometer_device.temperature == NULL)
     {
         printk(KERN_WARNING "INIT: Temperature buffer malloc failed\n");
@@ -190,6 +2626,26 @@ int thermometer_init_module(void)
     }
 
     mutex_init(thermometer_device.device_mutex);
+    thermometer_rate_limit_init(&thermometer_device.rate_limiter);
+    thermometer_simulation_init(&thermometer_device.simulation);
+
+#ifdef CONFIG_THERMOMETER_RING
+    result = thermometer_ring_init(&thermometer_device.ring, ring_pages);
+    if (result != 0)
+    {
+        printk(KERN_WARNING "INIT: Sample ring allocation failed\n");
+        goto ring_init_failed;
+    }
+#endif
+
+#ifdef CONFIG_THERMOMETER_FLIGHT
+    result = thermometer_flight_init(&thermometer_device.flight, recorder_address, recorder_size);
+    if (result != 0)
+    {
+        printk(KERN_WARNING "INIT: Flight recorder setup failed\n");
+        goto flight_init_failed;
+    }
+#endif
 
     result = gpio_request_one(OUTPUT_PIN, GPIOF_OUT_INIT_LOW, "OUTPUT_PIN");
     if (result != 0)
@@ -208,6 +2664,27 @@ int thermometer_init_module(void)
         goto request_input_pin_failed;
     }
 
+    result = thermometer_gpio_map(&thermometer_device);
+    if (result != 0)
+    {
+        printk(KERN_WARNING "INIT: GPIO register mapping failed\n");
+        goto gpio_map_failed;
+    }
+
+    result = thermometer_cpufreq_init(&thermometer_device);
+    if (result != 0)
+    {
+        printk(KERN_WARNING "INIT: cpufreq notifier registration failed: %pe\n", ERR_PTR(result));
+        goto cpufreq_init_failed;
+    }
+
+    result = thermometer_edge_init(&thermometer_device.edge);
+    if (result != 0)
+    {
+        printk(KERN_WARNING "INIT: Input pin edge IRQ setup failed: %pe\n", ERR_PTR(result));
+        goto edge_init_failed;
+    }
+
     result = thermometer_setup_cdev(&thermometer_device);
 
     if (result)
@@ -216,17 +2693,76 @@ int thermometer_init_module(void)
         goto setup_cdev_failed;
     }
 
+    result = thermometer_setup_state_cdev(&thermometer_device);
+    if (result)
+    {
+        printk(KERN_WARNING "INIT: State CDEV setup failed\n");
+        goto setup_state_cdev_failed;
+    }
+
+    result = thermometer_setup_flight_cdev(&thermometer_device);
+    if (result)
+    {
+        printk(KERN_WARNING "INIT: Flight recorder CDEV setup failed\n");
+        goto setup_flight_cdev_failed;
+    }
+
+    result = thermometer_setup_stream_cdev(&thermometer_device);
+    if (result)
+    {
+        printk(KERN_WARNING "INIT: Stream CDEV setup failed\n");
+        goto setup_stream_cdev_failed;
+    }
+
+    result = thermometer_sampler_start(&thermometer_device);
+    if (result)
+    {
+        printk(KERN_WARNING "INIT: Sampler start failed\n");
+        goto sampler_start_failed;
+    }
+
+    thermometer_watchdog_start(&thermometer_device);
+
     return 0;
+sampler_start_failed:
+#ifdef CONFIG_THERMOMETER_STREAM
+    cdev_del(&thermometer_device.stream_cdev);
+#endif
+setup_stream_cdev_failed:
+#ifdef CONFIG_THERMOMETER_FLIGHT
+    cdev_del(&thermometer_device.flight_cdev);
+#endif
+setup_flight_cdev_failed:
+#ifdef CONFIG_THERMOMETER_STATE
+    cdev_del(&thermometer_device.state_cdev);
+#endif
+setup_state_cdev_failed:
+    cdev_del(&thermometer_device.cdev);
 setup_cdev_failed:
+    thermometer_edge_free(&thermometer_device.edge);
+edge_init_failed:
+    thermometer_cpufreq_free(&thermometer_device);
+cpufreq_init_failed:
+    thermometer_gpio_unmap(&thermometer_device);
+gpio_map_failed:
     gpio_free(INPUT_PIN);
 request_input_pin_failed:
     gpio_free(OUTPUT_PIN);
 request_output_pin_failed:
+    thermometer_flight_free(&thermometer_device.flight);
+#ifdef CONFIG_THERMOMETER_FLIGHT
+flight_init_failed:
+#endif
+    thermometer_ring_free(&thermometer_device.ring);
+#ifdef CONFIG_THERMOMETER_RING
+ring_init_failed:
+#endif
     mutex_destroy(thermometer_device.device_mutex);
     kfree(thermometer_device.device_mutex);
 device_mutex_malloc_failed:
     kfree(thermometer_device.temperature);
 temperature_malloc_failed:
+    unregister_chrdev_region(dev, THERMOMETER_MINOR_COUNT);
 alloc_chrdev_failed:
 
     return result;
@@ -236,12 +2772,30 @@ void thermometer_cleanup_module(void)
 {
     dev_t devno = MKDEV(thermometer_major, thermometer_minor);
 
+    thermometer_watchdog_stop(&thermometer_device);
+    thermometer_sampler_stop(&thermometer_device);
+
+#ifdef CONFIG_THERMOMETER_STREAM
+    cdev_del(&thermometer_device.stream_cdev);
+#endif
+#ifdef CONFIG_THERMOMETER_FLIGHT
+    cdev_del(&thermometer_device.flight_cdev);
+#endif
+#ifdef CONFIG_THERMOMETER_STATE
+    cdev_del(&thermometer_device.state_cdev);
+#endif
     cdev_del(&thermometer_device.cdev);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, THERMOMETER_MINOR_COUNT);
 
+    thermometer_edge_free(&thermometer_device.edge);
+    thermometer_cpufreq_free(&thermometer_device);
+    thermometer_gpio_unmap(&thermometer_device);
     gpio_free(INPUT_PIN);
     gpio_free(OUTPUT_PIN);
+    thermometer_flight_free(&thermometer_device.flight);
+    thermometer_ring_free(&thermometer_device.ring);
+    thermometer_rate_limit_free(&thermometer_device.rate_limiter);
     mutex_destroy(thermometer_device.device_mutex);
     kfree(thermometer_device.device_mutex);
     kfree(thermometer_device.temperature);
@@ -1,28 +1,772 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
+#include <linux/completion.h>
+#include <linux/notifier.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/uidgid.h>
+#include <linux/poll.h>
+#include <linux/timekeeping.h>
+#include <linux/wait.h>
+
+#include "thermometer_abi.h"
+#include "thermometer_bcm2835.h"
+#include "thermometer_convert.h"
+
+// Each CONFIG_THERMOMETER_* feature is selected in the Makefile.  A disabled feature leaves an
+// empty struct in ThermometerDevice and static inline stubs behind, so that the call sites stay
+// the same and the compiler drops them.
+#if defined(CONFIG_THERMOMETER_STATE) && !defined(CONFIG_THERMOMETER_RING)
+#error "CONFIG_THERMOMETER_STATE needs CONFIG_THERMOMETER_RING"
+#endif
+
+#if defined(CONFIG_THERMOMETER_STREAM) && !defined(CONFIG_THERMOMETER_RING)
+#error "CONFIG_THERMOMETER_STREAM needs CONFIG_THERMOMETER_RING"
+#endif
+
+#if defined(CONFIG_THERMOMETER_HEALTH) && !defined(CONFIG_THERMOMETER_RING)
+#error "CONFIG_THERMOMETER_HEALTH needs CONFIG_THERMOMETER_RING, the metrics are published in its control page"
+#endif
+
+#if defined(CONFIG_THERMOMETER_SIMULATE) && !defined(CONFIG_THERMOMETER_SAMPLER)
+#error "CONFIG_THERMOMETER_SIMULATE needs CONFIG_THERMOMETER_SAMPLER, fast-forwarding runs its ticks"
+#endif
+
+typedef struct ThermometerRing
+{
+#ifdef CONFIG_THERMOMETER_RING
+    ThermometerRingPage *page;   // control page followed by the sample data, vmalloc_user'd
+    ThermometerRingTail *tail;   // the consumer's writable page, vmalloc_user'd
+    ThermometerSample *samples;
+    u64 head;                    // samples ever published, page->data_head is only a copy for readers
+    bool stale;                  // the newest sample is out of date, page->stale is a copy
+    u32 capacity;                // number of samples, always a power of 2
+    unsigned long size;          // size of the whole mapping in bytes
+    wait_queue_head_t wait;
+    u64 import_end;              // sequence after the last imported sample, lookups by time start there
+#endif
+} ThermometerRing;
+
+#define THERMOMETER_UID_BUCKET_BITS 4
+#define THERMOMETER_MAX_UID_BUCKETS 64U
+
+/// @brief Token bucket with the credit kept in nanoseconds, one measurement costs NSEC_PER_SEC / rate
+typedef struct ThermometerTokenBucket
+{
+    u64 credit;
+    u64 last_refill;
+} ThermometerTokenBucket;
+
+typedef struct ThermometerUidBucket
+{
+    kuid_t uid;
+    ThermometerTokenBucket bucket;
+    u64 limited_count;   // opens of this user served from the cached sample
+    struct hlist_node node;
+} ThermometerUidBucket;
+
+typedef struct ThermometerRateLimiter
+{
+#ifdef CONFIG_THERMOMETER_RATE_LIMIT
+    ThermometerTokenBucket global;
+    DECLARE_HASHTABLE(uid_buckets, THERMOMETER_UID_BUCKET_BITS);
+    unsigned int uid_bucket_count;
+    u64 limited_count;   // opens served from the cached sample
+#endif
+} ThermometerRateLimiter;
+
+#define THERMOMETER_BUDGET_WINDOW_NS (10 * NSEC_PER_SEC)
+
+/// @brief Accounts the CPU time spent measuring and holds it to cpu_budget_ppm of the wall time
+typedef struct ThermometerCpuBudget
+{
+#ifdef CONFIG_THERMOMETER_BUDGET
+    s64 credit;          // CPU time that may still be spent in ns, negative while in debt
+    u64 last_refill;
+    u64 window_start;
+    u64 window_cpu;      // CPU time spent since window_start in ns
+    unsigned int usage_ppm;  // CPU share of the last complete window
+    u64 skipped_count;   // measurements skipped to stay within the budget
+#endif
+} ThermometerCpuBudget;
+
+#define THERMOMETER_HEALTH_MIN_SAMPLES 16U
+#define THERMOMETER_HEALTH_FAST_SHIFT 4   // weight of a sample in the short term averages is 1/16
+#define THERMOMETER_HEALTH_SLOW_SHIFT 10  // and 1/1024 in the long term average
+
+/// @brief Running state behind the published ThermometerHealth
+/// @note metrics is the driver's own copy, the ring's control page only gets a copy of it for
+/// readers and is never read back
+typedef struct ThermometerHealthTracker
+{
+#ifdef CONFIG_THERMOMETER_HEALTH
+    ThermometerHealth metrics;
+    u64 samples;
+    u64 mean;            // short term average charge time in ns
+    u64 variance;        // short term variance in ns^2
+    u64 slow_mean;       // long term average charge time in ns
+    u64 stuck_value;     // charge time the current stuck run started with
+    u64 stuck_since;     // monotonic time the current stuck run started at
+    u32 timeout_ewma;    // timeout share in ppm
+    u64 timeout_count;
+#endif
+} ThermometerHealthTracker;
+
+#define THERMOMETER_COST_WINDOW 64U   // samples kept for the percentiles, a power of 2
+#define THERMOMETER_COST_SHIFT 4      // weight of a sample in the rolling averages is 1/16
+
+/// @brief The parts a measurement's cost is broken down into
+enum ThermometerCostPhase
+{
+    THERMOMETER_COST_TRIGGER = 0,      // from the trigger to the start of the charge
+    THERMOMETER_COST_IRQ = 1,          // edge IRQ entry latency taken off the charge, 0 when polled
+    THERMOMETER_COST_DISCHARGE = 2,    // sleeping while the capacitor discharges
+    THERMOMETER_COST_CHARGE_BUSY = 3,  // busy waiting for the input pin
+    THERMOMETER_COST_CHARGE_SLEEP = 4, // sleeping through the charge, hybrid and edge modes
+    THERMOMETER_COST_CONVERSION = 5,   // charge time to the cached text
+    THERMOMETER_COST_PUBLICATION = 6,  // health, ring and flight recorder
+    THERMOMETER_COST_CPU = 7,          // busy charge, conversion and publication together
+    THERMOMETER_COST_PHASES = 8,
+};
+
+/// @brief Rolling averages and a window of recent costs for each ThermometerCostPhase, in ns
+typedef struct ThermometerCostTracker
+{
+#ifdef CONFIG_THERMOMETER_COST
+    u32 mean[THERMOMETER_COST_PHASES];
+    u32 window[THERMOMETER_COST_PHASES][THERMOMETER_COST_WINDOW];
+    u64 samples;
+#endif
+} ThermometerCostTracker;
+
+#define THERMOMETER_CPUFREQ_ENTRIES 16U  // frequencies whose overhead is remembered
+#define THERMOMETER_CPUFREQ_READS 256U   // input pin reads timed to calibrate a frequency
+
+/// @brief The timing overhead of a polled charge at one CPU frequency
+typedef struct ThermometerOverhead
+{
+    unsigned int khz;
+    u32 overhead;        // ns the polled charge time reads long by
+} ThermometerOverhead;
+
+/// @brief Follows CPU frequency transitions and keeps the charge overhead of each frequency
+typedef struct ThermometerCpufreq
+{
+#ifdef CONFIG_THERMOMETER_CPUFREQ
+    struct notifier_block notifier;
+    bool registered;     // false when cpufreq is disabled
+    int cpu;             // CPU the last measurement ran on, only its policy's transitions count
+    unsigned int khz;    // current frequency of cpu, 0 without cpufreq
+    u32 generation;      // bumped before and after every transition
+    ThermometerOverhead table[THERMOMETER_CPUFREQ_ENTRIES];
+    u32 entries;
+    u32 next;            // entry replaced next once the table is full
+    unsigned int transitions;
+#endif
+} ThermometerCpufreq;
+
+#define THERMOMETER_NOWCAST_LEVEL_SHIFT 2      // weight of a residual in the charge time estimate is 1/4
+#define THERMOMETER_NOWCAST_TREND_SHIFT 4      // and 1/16 in the trend estimate
+#define THERMOMETER_NOWCAST_RESIDUAL_SHIFT 3   // weight of a sample in the residual average is 1/8
+#define THERMOMETER_NOWCAST_MAX_INTERVALS 4U   // extrapolation horizon cap in sample intervals
+
+/// @brief Level and trend filter of the charge time, extrapolated to the time of a read
+typedef struct ThermometerNowcast
+{
+#ifdef CONFIG_THERMOMETER_NOWCAST
+    s64 level;           // filtered charge time at last_time in ns
+    s64 trend;           // filtered change of the charge time in ns per second
+    u64 residual;        // average absolute prediction error in ns
+    u64 interval;        // average time between samples in ns
+    u64 last_time;       // monotonic time of the last sample
+    u32 samples;
+#endif
+} ThermometerNowcast;
+
+/// @brief The virtual clock and charge model that stand in for time and the RC circuit
+typedef struct ThermometerSimulation
+{
+#ifdef CONFIG_THERMOMETER_SIMULATE
+    bool active;         // the simulate parameter at load, fixed afterwards
+    u64 now;             // virtual monotonic time in ns, only moves forward
+    u64 next_tick;       // virtual time of the periodic and aligned sampler's next tick
+    u64 ticks;           // sampler ticks run by fast-forwarding
+    u32 seed;            // state of the charge time noise
+#endif
+} ThermometerSimulation;
+
+/// @brief How the background sampler schedules measurements
+enum ThermometerSampleMode
+{
+    THERMOMETER_MODE_OPEN = 0,      // no sampler, every open measures
+    THERMOMETER_MODE_PERIODIC = 1,  // every sample_interval_ms on CLOCK_MONOTONIC
+    THERMOMETER_MODE_ALIGNED = 2,   // on multiples of sample_interval_ms of CLOCK_REALTIME
+    THERMOMETER_MODE_EXTERNAL = 3,  // on rising edges of trigger_gpio
+};
+
+/// @brief How the end of the charge is detected
+enum ThermometerChargeMode
+{
+    THERMOMETER_CHARGE_POLL = 0,    // busy loop on the input pin
+    THERMOMETER_CHARGE_EDGE = 1,    // timestamp of the input pin's rising edge IRQ
+    THERMOMETER_CHARGE_HYBRID = 2,  // sleep until shortly before the predicted edge, then busy loop
+};
+
+#define THERMOMETER_EDGE_SHIFT 3  // weight of a measured latency in the latency model is 1/8
+#define THERMOMETER_EDGE_WINDOW_NS (100 * NSEC_PER_USEC)        // interrupts off this long before the predicted edge
+#define THERMOMETER_EDGE_MAX_LATENCY_NS (100 * NSEC_PER_USEC)   // longer latencies are taken as outliers
+
+/// @brief Edge IRQ capture of the end of the charge, and the model of its entry latency
+typedef struct ThermometerEdge
+{
+#ifdef CONFIG_THERMOMETER_EDGE_IRQ
+    int irq;                 // -1 while charges are polled
+    struct completion done;
+    bool armed;              // a charge is waiting for the edge
+    u64 time;                // monotonic time taken on entry to the IRQ handler
+    u64 charges;
+    u64 latency_mean;        // average IRQ entry latency measured on calibration charges in ns
+    u32 latency_samples;
+    unsigned int latency;    // IRQ entry latency subtracted from the edge timestamps in ns
+#endif
+} ThermometerEdge;
+
+typedef struct ThermometerSampler
+{
+#ifdef CONFIG_THERMOMETER_SAMPLER
+    struct hrtimer timer;
+    struct work_struct work;
+    u64 trigger_time;   // monotonic time the pending measurement was triggered at
+    u16 trigger;        // enum ThermometerTrigger of the pending measurement
+    int trigger_irq;
+    bool running;
+    struct delayed_work watchdog;
+    u64 last_progress;  // monotonic time of the last published or deliberately skipped sample
+    unsigned int recoveries;
+#endif
+} ThermometerSampler;
+
+/// @brief Compact trace of recent samples kept in a reserved region of RAM that survives a reset
+typedef struct ThermometerFlightRecorder
+{
+#ifdef CONFIG_THERMOMETER_FLIGHT
+    ThermometerFlightHeader *header;     // memremap'd region, NULL when the recorder is disabled
+    ThermometerFlightRecord *records;
+    char *recovered;                     // the trace left by the previous boot, if any
+    size_t recovered_length;
+#endif
+} ThermometerFlightRecorder;
 
 typedef struct ThermometerDevice
 {
     char *temperature;
     struct mutex *device_mutex;
     struct cdev cdev;
+#ifdef CONFIG_THERMOMETER_STATE
+    struct cdev state_cdev;
+#endif
+#ifdef CONFIG_THERMOMETER_FLIGHT
+    struct cdev flight_cdev;
+#endif
+#ifdef CONFIG_THERMOMETER_STREAM
+    struct cdev stream_cdev;
+#endif
+    ThermometerRing ring;
+    ThermometerCalibration calibration;
+    ThermometerSample last_sample;
+    ThermometerRateLimiter rate_limiter;
+    ThermometerSampler sampler;
+    ThermometerCpuBudget budget;
+    ThermometerHealthTracker health;
+    ThermometerFlightRecorder flight;
+    ThermometerCostTracker costs;
+    ThermometerEdge edge;
+    unsigned int charge_misses;   // hybrid charges that slept past the edge
+    ThermometerCpufreq cpufreq;
+    ThermometerNowcast nowcast;
+    ThermometerSimulation simulation;
+#ifdef CONFIG_THERMOMETER_BCM2835
+    ThermometerBcm2835Regs gpio_regs;  // NULL while the pins are driven through gpiolib
+#endif
 } ThermometerDevice;
 
+#ifdef CONFIG_THERMOMETER_STREAM
+#define THERMOMETER_STREAM_LINE_LENGTH 48U
+
+/// @brief The position of one open of the stream node in the ring, and the line being read
+typedef struct ThermometerStream
+{
+    ThermometerDevice *device;
+    u64 cursor;      // ring sequence number of the next sample to read
+    char line[THERMOMETER_STREAM_LINE_LENGTH];
+    size_t length;   // length of the line
+    size_t offset;   // part of the line already read
+} ThermometerStream;
+#endif
+
+#ifdef CONFIG_THERMOMETER_STATE
+/// @brief A snapshot of, or an incoming, warm start blob for one open of the state node
+typedef struct ThermometerStateFile
+{
+    char *data;
+    size_t length;   // number of valid bytes in data
+    size_t size;     // allocated size of data
+    bool written;
+} ThermometerStateFile;
+#endif
+
+#ifdef THERMOMETER_USE_LUT
+/// @brief Converts a resistance into a temperature by interpolating the generated R-T table
+/// @note resistances outside the table are clamped to its ends
+/// @param[in] resistance the resistance of the thermistor
+/// @return the temperature in millidegrees C
+int thermometer_lut_lookup(int resistance);
+#endif
+
 /// @brief Calculates the resistance based on the time elapsed.
-/// @note the equation used in determining the resistance from the time was empirically
-/// determined based on my own hardware setup.
+/// @note the default calibration was empirically determined based on my own hardware setup.
+/// @param[in] calibration the calibration constants to use
 /// @param[in] time_elapsed the time that it took for the capaciter to be charged
 /// @return the resistance of the variable resistor
-int time_to_resistance(u64 time_elapsed);
+int time_to_resistance(const ThermometerCalibration *calibration, u64 time_elapsed);
 
 /// @brief Calculates the temperature based on the resistance of the thermistor
-/// @note this is very loosely based on the data sheet for the thermistor I am using.
+/// @note the default calibration is very loosely based on the data sheet for the thermistor I am using.
 /// I took some shortcuts since this will only be used around room temperature.
+/// When built with THERMOMETER_RT_CSV the generated table is used instead, and only the
+/// time_to_resistance constants of the calibration apply.
+/// @param[in] calibration the calibration constants to use
 /// @param[in] resistance the resistance of the thermistor
 /// @return the temperature of the thermistor
-int resistance_to_temperature(int resistance);
+int resistance_to_temperature(const ThermometerCalibration *calibration, int resistance);
+
+#ifdef CONFIG_THERMOMETER_RING
+/// @brief Allocates the sample ring shared with user space
+/// @param[out] ring the ring to set up
+/// @param[in] pages the number of data pages, rounded up to a power of 2
+/// @return 0 on success, -E otherwise
+int thermometer_ring_init(ThermometerRing *ring, unsigned int pages);
+
+/// @brief Frees the sample ring
+/// @param[in] ring the ring to free
+void thermometer_ring_free(ThermometerRing *ring);
+
+/// @brief Refreshes the monotonic to BOOTTIME, REALTIME and TAI offsets in the control page
+/// @note must be called with the device mutex held
+/// @param[in] ring the ring to update
+/// @param[in] now the monotonic time the offsets are taken at
+void thermometer_ring_update_offsets(ThermometerRing *ring, u64 now);
+
+/// @brief Appends a sample to the ring, overwriting the oldest one if it is full, refreshes the clock
+/// offsets and wakes up pollers.
+/// @note must be called with the device mutex held, as the ring only supports a single producer
+/// @param[in] ring the ring to publish to
+/// @param[in] sample the sample to publish
+void thermometer_ring_publish(ThermometerRing *ring, const ThermometerSample *sample);
+
+/// @brief Flags whether the last published sample is stale, e.g. while the sampler is recovering
+/// @param[in] ring the ring to flag
+/// @param[in] stale whether readers should distrust the last sample
+void thermometer_ring_set_stale(ThermometerRing *ring, bool stale);
+
+/// @brief Marks everything published so far as imported, it is left out of lookups by time
+/// @note must be called with the device mutex held, after publishing a warm start blob's samples
+/// @param[in] ring the ring the samples were imported into
+void thermometer_ring_mark_imported(ThermometerRing *ring);
+
+/// @brief Binary searches the ring for the oldest sample taken at or after a time
+/// @note must be called with the device mutex held.  Only the samples published since the last
+/// import are searched: imported samples carry the clock of an earlier boot, and the samples
+/// before them can't be ordered against them.
+/// @param[in] ring the ring to search
+/// @param[in] timestamp the monotonic time in ns
+/// @return the sequence number of the sample, data_head if there is none
+u64 thermometer_ring_find(const ThermometerRing *ring, u64 timestamp);
+
+/// @brief Handles THERMOMETER_IOC_FIND and THERMOMETER_IOC_READ_RANGE
+/// @param[in] device the device whose ring to search
+/// @param[in] cmd the ioctl command
+/// @param[in,out] arg user pointer to a ThermometerRange
+/// @param[out] sequence set to the sequence found, may be NULL
+/// @return 0 on success, -E on error
+long thermometer_ring_ioctl(ThermometerDevice *device, unsigned int cmd, unsigned long arg, u64 *sequence);
+#else
+static inline int thermometer_ring_init(ThermometerRing *ring, unsigned int pages) { return 0; }
+static inline void thermometer_ring_free(ThermometerRing *ring) {}
+static inline void thermometer_ring_publish(ThermometerRing *ring, const ThermometerSample *sample) {}
+static inline void thermometer_ring_set_stale(ThermometerRing *ring, bool stale) {}
+static inline long thermometer_ring_ioctl(ThermometerDevice *device, unsigned int cmd, unsigned long arg,
+                                          u64 *sequence)
+{
+    return -ENOTTY;
+}
+#endif
+
+/// @brief Takes a measurement, stores it as the cached temperature and publishes it to the ring
+/// @note must be called with the device mutex held
+/// @param[in] device the device to measure with
+/// @param[in] trigger the enum ThermometerTrigger that caused the measurement
+/// @param[in] trigger_time the monotonic time of the trigger, used for the trigger latency
+/// @return 0 on success, -ETIMEDOUT if the capacitor didn't charge within charge_timeout_ms
+int thermometer_measure(ThermometerDevice *device, u16 trigger, u64 trigger_time);
+
+#ifdef CONFIG_THERMOMETER_FLIGHT
+/// @brief Maps the persistent region, recovers the trace left in it and starts a new one
+/// @param[out] recorder the recorder to set up
+/// @param[in] address the physical address of the region, 0 to disable the recorder
+/// @param[in] size the size of the region in bytes
+/// @return 0 on success, -E otherwise
+int thermometer_flight_init(ThermometerFlightRecorder *recorder, phys_addr_t address, size_t size);
+
+/// @brief Unmaps the persistent region and frees the recovered trace
+/// @param[in] recorder the recorder to free
+void thermometer_flight_free(ThermometerFlightRecorder *recorder);
+
+/// @brief Appends an entry to the flight recorder, a no-op when it is disabled
+/// @note must be called with the device mutex held
+/// @param[in] recorder the recorder to append to
+/// @param[in] kind the enum ThermometerFlightKind of the entry
+/// @param[in] temperature the temperature in degrees C
+/// @param[in] detail kind specific detail
+/// @param[in] now the current monotonic time in ns
+void thermometer_flight_record(ThermometerFlightRecorder *recorder, u8 kind, int temperature, u8 detail, u64 now);
+#else
+static inline int thermometer_flight_init(ThermometerFlightRecorder *recorder, phys_addr_t address, size_t size)
+{
+    return 0;
+}
+static inline void thermometer_flight_free(ThermometerFlightRecorder *recorder) {}
+static inline void thermometer_flight_record(ThermometerFlightRecorder *recorder, u8 kind, int temperature,
+                                             u8 detail, u64 now) {}
+#endif
+
+#ifdef CONFIG_THERMOMETER_HEALTH
+/// @brief Feeds a measurement attempt into the health metrics and publishes them
+/// @note must be called with the device mutex held
+/// @param[in] device the device that was measured
+/// @param[in] charge_time the charge time in ns, ignored if timed_out
+/// @param[in] timed_out whether the charge timed out
+/// @param[in] now the current monotonic time in ns
+/// @return true if the health state changed
+bool thermometer_health_update(ThermometerDevice *device, u64 charge_time, bool timed_out, u64 now);
+
+/// @brief Restarts the drift baseline, e.g. after the calibration changed
+/// @param[in] device the device whose baseline to reset
+void thermometer_health_reset_baseline(ThermometerDevice *device);
+
+/// @brief Counts a re-request of the edge IRQ by the watchdog and publishes it
+/// @param[in] device the device whose IRQ was re-requested
+void thermometer_health_irq_restart(ThermometerDevice *device);
+
+/// @brief Copies the health statistics and baseline into a warm start blob
+/// @note must be called with the device mutex held
+/// @param[in] device the device to export
+/// @param[out] filters the blob's filter state
+void thermometer_health_save(const ThermometerDevice *device, ThermometerStateFilters *filters);
+
+/// @brief Loads the health statistics and baseline of a warm start blob, or restarts the baseline
+/// if the blob has none
+/// @note must be called with the device mutex held
+/// @param[in] device the device to import into
+/// @param[in] filters the blob's filter state
+/// @param[in] now the current monotonic time in ns
+void thermometer_health_restore(ThermometerDevice *device, const ThermometerStateFilters *filters, u64 now);
+#else
+static inline bool thermometer_health_update(ThermometerDevice *device, u64 charge_time, bool timed_out, u64 now)
+{
+    return false;
+}
+static inline void thermometer_health_reset_baseline(ThermometerDevice *device) {}
+static inline void thermometer_health_irq_restart(ThermometerDevice *device) {}
+static inline void thermometer_health_save(const ThermometerDevice *device, ThermometerStateFilters *filters) {}
+static inline void thermometer_health_restore(ThermometerDevice *device, const ThermometerStateFilters *filters,
+                                              u64 now) {}
+#endif
+
+#ifdef CONFIG_THERMOMETER_COST
+/// @brief Reads the clock for the cost breakdown of a measurement
+/// @return the current monotonic time in ns, 0 when cost accounting is compiled out
+static inline u64 thermometer_cost_clock(void)
+{
+    return ktime_get_mono_fast_ns();
+}
+
+/// @brief Adds the cost breakdown of a published sample to the averages and the window
+/// @note must be called with the device mutex held
+/// @param[in] costs the cost tracker of the device
+/// @param[in] phases the cost of each ThermometerCostPhase in ns
+void thermometer_cost_record(ThermometerCostTracker *costs, const u64 *phases);
+#else
+static inline u64 thermometer_cost_clock(void) { return 0; }
+static inline void thermometer_cost_record(ThermometerCostTracker *costs, const u64 *phases) {}
+#endif
+
+#ifdef CONFIG_THERMOMETER_BUDGET
+/// @brief Decides whether the CPU budget leaves room for another measurement
+/// @note must be called with the device mutex held
+/// @param[in] budget the budget of the device
+/// @param[in] now the current monotonic time in ns
+/// @return true if the measurement may be taken, false if it should be skipped
+bool thermometer_budget_allow(ThermometerCpuBudget *budget, u64 now);
+
+/// @brief Charges the CPU time of a measurement against the budget
+/// @note must be called with the device mutex held
+/// @param[in] budget the budget of the device
+/// @param[in] cost the CPU time the measurement took in ns
+/// @param[in] now the current monotonic time in ns
+void thermometer_budget_charge(ThermometerCpuBudget *budget, u64 cost, u64 now);
+#else
+static inline bool thermometer_budget_allow(ThermometerCpuBudget *budget, u64 now) { return true; }
+static inline void thermometer_budget_charge(ThermometerCpuBudget *budget, u64 cost, u64 now) {}
+#endif
+
+#ifdef CONFIG_THERMOMETER_BCM2835
+/// @brief Maps the BCM2835 GPIO registers when fast_gpio asks for it
+/// @note the pins are still requested and configured through gpiolib
+/// @param[in] device the device whose pins to drive directly
+/// @return 0 on success, -E otherwise
+int thermometer_gpio_map(ThermometerDevice *device);
+
+/// @brief Unmaps the BCM2835 GPIO registers if they were mapped
+/// @param[in] device the device whose pins were driven directly
+void thermometer_gpio_unmap(ThermometerDevice *device);
+#else
+static inline int thermometer_gpio_map(ThermometerDevice *device) { return 0; }
+static inline void thermometer_gpio_unmap(ThermometerDevice *device) {}
+#endif
+
+#ifdef CONFIG_THERMOMETER_SIMULATE
+/// @brief Starts the virtual clock at the current monotonic time when simulate is set
+/// @param[out] simulation the simulation state of the device
+void thermometer_simulation_init(ThermometerSimulation *simulation);
+
+/// @brief Takes a charge from the model instead of the pins, advancing the virtual clock by it
+/// @note must be called with the device mutex held
+/// @param[in] device the simulated device
+/// @param[out] start the virtual time the charge started at
+/// @param[out] end the virtual time the charge ended at
+/// @param[out] slept all of the charge, it costs no CPU time
+/// @return 0 on success, -ETIMEDOUT if the model's charge time exceeds charge_timeout_ms
+int thermometer_simulation_charge(ThermometerDevice *device, u64 *start, u64 *end, u64 *slept);
+
+/// @brief Runs the sampler's ticks and watchdog checks over a span of virtual time without waiting
+/// @param[in] device the simulated device
+/// @param[in] duration the virtual time to advance by in ns
+/// @return 0 on success, -EINVAL if the device isn't simulated, -EOVERFLOW if the virtual clock
+///         would wrap, -EINTR if the caller was killed
+int thermometer_simulation_advance(ThermometerDevice *device, u64 duration);
+
+/// @brief Whether the device runs on the virtual clock and charge model
+static inline bool thermometer_simulated(const ThermometerDevice *device)
+{
+    return device->simulation.active;
+}
+
+/// @brief Advances the virtual clock in place of a sleep
+/// @note must be called with the device mutex held
+static inline void thermometer_simulation_sleep(ThermometerDevice *device, unsigned int ms)
+{
+    WRITE_ONCE(device->simulation.now, device->simulation.now + (u64)ms * NSEC_PER_MSEC);
+}
+
+static inline u64 thermometer_simulation_now(const ThermometerDevice *device)
+{
+    return READ_ONCE(device->simulation.now);
+}
+#else
+static inline void thermometer_simulation_init(ThermometerSimulation *simulation) {}
+static inline int thermometer_simulation_charge(ThermometerDevice *device, u64 *start, u64 *end, u64 *slept)
+{
+    return -ENODEV;
+}
+static inline bool thermometer_simulated(const ThermometerDevice *device) { return false; }
+static inline void thermometer_simulation_sleep(ThermometerDevice *device, unsigned int ms) {}
+static inline u64 thermometer_simulation_now(const ThermometerDevice *device) { return 0; }
+#endif
+
+/// @brief The monotonic time the device runs on, the virtual clock when simulated
+/// @param[in] device the device
+/// @return the time in ns
+static inline u64 thermometer_clock(const ThermometerDevice *device)
+{
+    if (thermometer_simulated(device))
+        return thermometer_simulation_now(device);
 
-/// @brief The open command for this device driver.  Stores the current temperature in a string buffer.
+    return ktime_get_mono_fast_ns();
+}
+
+#ifdef CONFIG_THERMOMETER_NOWCAST
+/// @brief Feeds a sample's charge time into the level and trend filter
+/// @note must be called with the device mutex held
+/// @param[in] nowcast the filter of the device
+/// @param[in] charge_time the corrected charge time in ns
+/// @param[in] now the monotonic time of the sample
+void thermometer_nowcast_update(ThermometerNowcast *nowcast, u64 charge_time, u64 now);
+
+/// @brief Replaces the cached text with the temperature extrapolated to now and its uncertainty,
+/// when the nowcast parameter is set and the filter has seen enough samples
+/// @note must be called with the device mutex held
+/// @param[in] device the device to read
+/// @param[in] now the monotonic time to extrapolate to
+void thermometer_nowcast_format(ThermometerDevice *device, u64 now);
+
+/// @brief Copies the filter into a warm start blob
+/// @note must be called with the device mutex held
+/// @param[in] nowcast the filter of the device
+/// @param[out] filters the blob's filter state
+void thermometer_nowcast_save(const ThermometerNowcast *nowcast, ThermometerStateFilters *filters);
+
+/// @brief Loads the filter of a warm start blob, leaving it alone if the blob has none
+/// @note must be called with the device mutex held
+/// @param[in] nowcast the filter of the device
+/// @param[in] filters the blob's filter state
+/// @param[in] now the current monotonic time in ns
+void thermometer_nowcast_restore(ThermometerNowcast *nowcast, const ThermometerStateFilters *filters, u64 now);
+#else
+static inline void thermometer_nowcast_update(ThermometerNowcast *nowcast, u64 charge_time, u64 now) {}
+static inline void thermometer_nowcast_format(ThermometerDevice *device, u64 now) {}
+static inline void thermometer_nowcast_save(const ThermometerNowcast *nowcast, ThermometerStateFilters *filters) {}
+static inline void thermometer_nowcast_restore(ThermometerNowcast *nowcast, const ThermometerStateFilters *filters,
+                                               u64 now) {}
+#endif
+
+#ifdef CONFIG_THERMOMETER_CPUFREQ
+/// @brief Registers the cpufreq transition notifier
+/// @note without cpufreq, e.g. booted with cpufreq.off=1, the notifier isn't registered and the
+/// frequency stays 0, which leaves a single overhead entry
+/// @param[in] device the device whose charges to correct
+/// @return 0 on success, -E otherwise
+int thermometer_cpufreq_init(ThermometerDevice *device);
+
+/// @brief Unregisters the cpufreq transition notifier
+/// @param[in] device the device whose charges were corrected
+void thermometer_cpufreq_free(ThermometerDevice *device);
+
+/// @brief Looks up the charge overhead at the current CPU frequency, calibrating it on first use
+/// @note must be called with the device mutex held and the output pin low
+/// @param[in] device the device to measure with
+/// @return the overhead in ns
+u32 thermometer_cpufreq_overhead(ThermometerDevice *device);
+
+/// @brief A counter that changes whenever a frequency transition starts or ends
+/// @param[in] device the device to measure with
+static inline u32 thermometer_cpufreq_generation(const ThermometerDevice *device)
+{
+    return READ_ONCE(device->cpufreq.generation);
+}
+#else
+static inline int thermometer_cpufreq_init(ThermometerDevice *device) { return 0; }
+static inline void thermometer_cpufreq_free(ThermometerDevice *device) {}
+static inline u32 thermometer_cpufreq_overhead(ThermometerDevice *device) { return 0; }
+static inline u32 thermometer_cpufreq_generation(const ThermometerDevice *device) { return 0; }
+#endif
+
+#ifdef CONFIG_THERMOMETER_EDGE_IRQ
+/// @brief Requests the input pin's rising edge IRQ when charge_mode asks for it
+/// @param[out] edge the edge capture to set up
+/// @return 0 on success, -E otherwise
+int thermometer_edge_init(ThermometerEdge *edge);
+
+/// @brief Frees the input pin's IRQ if it was requested
+/// @param[in] edge the edge capture to free
+void thermometer_edge_free(ThermometerEdge *edge);
+
+/// @brief Whether charges are currently timed by the edge IRQ
+/// @param[in] edge the edge capture to check
+/// @return true if the IRQ is requested
+static inline bool thermometer_edge_active(const ThermometerEdge *edge) { return edge->irq >= 0; }
+
+/// @brief The IRQ entry latency taken off edge timed charges
+/// @param[in] edge the edge capture to check
+/// @return the latency in ns, 0 while charges are polled
+static inline u32 thermometer_edge_latency(const ThermometerEdge *edge)
+{
+    return edge->irq >= 0 ? READ_ONCE(edge->latency) : 0;
+}
+#else
+static inline int thermometer_edge_init(ThermometerEdge *edge) { return 0; }
+static inline void thermometer_edge_free(ThermometerEdge *edge) {}
+static inline bool thermometer_edge_active(const ThermometerEdge *edge) { return false; }
+static inline u32 thermometer_edge_latency(const ThermometerEdge *edge) { return 0; }
+#endif
+
+/// @brief Charges the capacitor until the input pin goes high, timing it as charge_mode says
+/// @note must be called with the device mutex held, the output pin is left high
+/// @param[in] device the device to measure with
+/// @param[out] start the monotonic time the charge started at
+/// @param[out] end the monotonic time the input pin went high, corrected for the IRQ entry latency
+/// @param[out] slept the part of the charge spent sleeping rather than on the CPU in ns
+/// @return 0 on success, -ETIMEDOUT if the capacitor didn't charge within charge_timeout_ms
+int thermometer_charge(ThermometerDevice *device, u64 *start, u64 *end, u64 *slept);
+
+#ifdef CONFIG_THERMOMETER_SAMPLER
+/// @brief Starts the background sampler in the configured sample_mode
+/// @param[in] device the device to sample
+/// @return 0 on success, -E otherwise
+int thermometer_sampler_start(ThermometerDevice *device);
+
+/// @brief Stops the background sampler and waits for a pending measurement to finish
+/// @param[in] device the device being sampled
+void thermometer_sampler_stop(ThermometerDevice *device);
+
+/// @brief Starts the watchdog that recovers the sampler when it stops publishing samples
+/// @param[in] device the device being sampled
+void thermometer_watchdog_start(ThermometerDevice *device);
+
+/// @brief Stops the watchdog
+/// @param[in] device the device being sampled
+void thermometer_watchdog_stop(ThermometerDevice *device);
+
+/// @brief Whether the background sampler keeps the cached sample fresh
+/// @param[in] device the device being sampled
+static inline bool thermometer_sampler_running(const ThermometerDevice *device)
+{
+    return device->sampler.running;
+}
+
+/// @brief Tells the watchdog that the sampler is alive
+/// @param[in] device the device being sampled
+/// @param[in] now the current monotonic time in ns
+static inline void thermometer_sampler_progress(ThermometerDevice *device, u64 now)
+{
+    device->sampler.last_progress = now;
+}
+#else
+static inline int thermometer_sampler_start(ThermometerDevice *device) { return 0; }
+static inline void thermometer_sampler_stop(ThermometerDevice *device) {}
+static inline void thermometer_watchdog_start(ThermometerDevice *device) {}
+static inline void thermometer_watchdog_stop(ThermometerDevice *device) {}
+static inline bool thermometer_sampler_running(const ThermometerDevice *device) { return false; }
+static inline void thermometer_sampler_progress(ThermometerDevice *device, u64 now) {}
+#endif
+
+#ifdef CONFIG_THERMOMETER_RATE_LIMIT
+/// @brief Sets up the empty per user bucket table
+/// @param[out] limiter the rate limiter to set up
+void thermometer_rate_limit_init(ThermometerRateLimiter *limiter);
+
+/// @brief Decides whether a hardware measurement may be taken, taking a token from the global
+/// and the user's bucket if so
+/// @note must be called with the device mutex held
+/// @param[in] limiter the rate limiter of the device
+/// @param[in] uid the user asking for the measurement
+/// @param[in] now the current monotonic time in ns
+/// @return true if the measurement may be taken, false if the cached sample should be used
+bool thermometer_rate_limit_allow(ThermometerRateLimiter *limiter, kuid_t uid, u64 now);
+
+/// @brief Frees the per user buckets of the rate limiter
+/// @param[in] limiter the rate limiter to free
+void thermometer_rate_limit_free(ThermometerRateLimiter *limiter);
+#else
+static inline void thermometer_rate_limit_init(ThermometerRateLimiter *limiter) {}
+static inline bool thermometer_rate_limit_allow(ThermometerRateLimiter *limiter, kuid_t uid, u64 now) { return true; }
+static inline void thermometer_rate_limit_free(ThermometerRateLimiter *limiter) {}
+#endif
+
+/// @brief The open command for this device driver.  Stores the current temperature in a string buffer,
+/// or keeps the cached one when the caller is rate limited or the background sampler is running,
+/// extrapolated to the time of the open when the nowcast parameter is set.
 /// @param[in] inode the inode of the device
 /// @param[in] filp information about how the file is being accessed
 /// @return 0 on success, -E on error
@@ -43,11 +787,158 @@ int thermometer_release(struct inode *inode, struct file *filp);
 ssize_t thermometer_read(struct file *filp, char __user *buf, size_t count,
                          loff_t *f_pos);
 
+#ifdef CONFIG_THERMOMETER_RING
+/// @brief The mmap command for this device driver.  Maps the sample ring into user space.
+/// @param[in] filp information about how the file is being accessed
+/// @param[in] vma the user space mapping, must cover the control page or the whole ring starting
+/// at offset 0, or the consumer's tail page at tail_offset
+/// @return 0 on success, -E on error
+int thermometer_mmap(struct file *filp, struct vm_area_struct *vma);
+
+/// @brief The poll command for this device driver.  Readable while the ring holds unconsumed samples.
+/// @param[in] filp information about how the file is being accessed
+/// @param[in] wait the poll table to register the ring's wait queue with
+/// @return the poll mask
+__poll_t thermometer_poll(struct file *filp, struct poll_table_struct *wait);
+#endif
+
+/// @brief The ioctl command for this device driver.  Looks up and copies samples by time, and
+/// fast-forwards a simulated device.
+/// @param[in] filp information about how the file is being accessed
+/// @param[in] cmd THERMOMETER_IOC_FIND, THERMOMETER_IOC_READ_RANGE or THERMOMETER_IOC_SIMULATE_ADVANCE
+/// @param[in,out] arg user pointer to a ThermometerRange, or to the __u64 ms to advance by
+/// @return 0 on success, -E on error
+long thermometer_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+#ifdef CONFIG_THERMOMETER_STATE
+/// @brief Serializes the calibration, the last sample and the ring contents into a warm start blob
+/// @note must be called with the device mutex held
+/// @param[in] device the device to export
+/// @param[out] state the file state to fill, data is allocated here
+/// @return 0 on success, -E otherwise
+int thermometer_state_export(ThermometerDevice *device, ThermometerStateFile *state);
+
+/// @brief Validates a warm start blob and loads it into the device
+/// @note must be called with the device mutex held
+/// @param[in] device the device to import into
+/// @param[in] data the blob
+/// @param[in] length the length of the blob in bytes
+/// @return 0 on success, -E otherwise
+int thermometer_state_import(ThermometerDevice *device, const char *data, size_t length);
+
+/// @brief The open command for the state node.  Snapshots the current state for reading.
+/// @param[in] inode the inode of the device
+/// @param[in] filp information about how the file is being accessed
+/// @return 0 on success, -E on error
+int thermometer_state_open(struct inode *inode, struct file *filp);
+
+/// @brief The flush command for the state node.  Imports the blob if one was written, so a
+///        rejected blob fails close(2).
+/// @param[in] filp information about how the file is being accessed
+/// @param[in] id the owner of the descriptor being closed
+/// @return 0 on success, -E on error
+int thermometer_state_flush(struct file *filp, fl_owner_t id);
+
+/// @brief The close command for the state node.  Frees the buffered blob.
+/// @param[in] inode the inode of the device
+/// @param[in] filp information about how the file is being accessed
+/// @return 0 on success, -E on error
+int thermometer_state_release(struct inode *inode, struct file *filp);
+
+/// @brief The read command for the state node.  Returns the snapshot taken at open.
+/// @param[in] filp information about how the file is being accessed
+/// @param[out] buf buffer for user data
+/// @param[in] count how many bytes to read
+/// @param[in,out] f_pos the position to read from
+/// @return how many bytes were read, -E on error
+ssize_t thermometer_state_read(struct file *filp, char __user *buf, size_t count,
+                               loff_t *f_pos);
+
+/// @brief The write command for the state node.  Buffers a blob to be imported on close.
+/// @param[in] filp information about how the file is being accessed
+/// @param[in] buf buffer with user data
+/// @param[in] count how many bytes to write
+/// @param[in,out] f_pos the position to write to
+/// @return how many bytes were written, -E on error
+ssize_t thermometer_state_write(struct file *filp, const char __user *buf, size_t count,
+                                loff_t *f_pos);
+#endif
+
+#ifdef CONFIG_THERMOMETER_FLIGHT
+/// @brief The open command for the flight recorder node.
+/// @param[in] inode the inode of the device
+/// @param[in] filp information about how the file is being accessed
+/// @return 0 on success, -E on error
+int thermometer_flight_open(struct inode *inode, struct file *filp);
+
+/// @brief The read command for the flight recorder node.  Returns the trace recovered at load.
+/// @param[in] filp information about how the file is being accessed
+/// @param[out] buf buffer for user data
+/// @param[in] count how many bytes to read
+/// @param[in,out] f_pos the position to read from
+/// @return how many bytes were read, -E on error
+ssize_t thermometer_flight_read(struct file *filp, char __user *buf, size_t count,
+                                loff_t *f_pos);
+#endif
+
+#ifdef CONFIG_THERMOMETER_STREAM
+/// @brief The open command for the stream node.  Starts reading at the next published sample.
+/// @param[in] inode the inode of the device
+/// @param[in] filp information about how the file is being accessed
+/// @return 0 on success, -E on error
+int thermometer_stream_open(struct inode *inode, struct file *filp);
+
+/// @brief The close command for the stream node.
+/// @param[in] inode the inode of the device
+/// @param[in] filp information about how the file is being accessed
+/// @return 0 on success, -E on error
+int thermometer_stream_release(struct inode *inode, struct file *filp);
+
+/// @brief The read command for the stream node.  Blocks for the next sample and returns it as a line
+/// of its monotonic timestamp in ns and its temperature.
+/// @param[in] filp information about how the file is being accessed
+/// @param[out] buf buffer for user data
+/// @param[in] count how many bytes to read
+/// @param[in,out] f_pos unused, the stream has no position
+/// @return how many bytes were read, -E on error
+ssize_t thermometer_stream_read(struct file *filp, char __user *buf, size_t count,
+                                loff_t *f_pos);
+
+/// @brief The poll command for the stream node.  Readable while a sample or part of a line is left.
+/// @param[in] filp information about how the file is being accessed
+/// @param[in] wait the poll table to register the ring's wait queue with
+/// @return the poll mask
+__poll_t thermometer_stream_poll(struct file *filp, struct poll_table_struct *wait);
+
+/// @brief The ioctl command for the stream node.  THERMOMETER_IOC_FIND moves the reader to the
+/// sample found, dropping what is left of the current line.
+/// @param[in] filp information about how the file is being accessed
+/// @param[in] cmd THERMOMETER_IOC_FIND or THERMOMETER_IOC_READ_RANGE
+/// @param[in,out] arg user pointer to a ThermometerRange
+/// @return 0 on success, -E on error
+long thermometer_stream_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+#endif
+
 /// @brief Tells linux that the device is ready for use
 /// @param[in] dev the device that was created
 /// @return 0 on success, -E otherwise
 static int thermometer_setup_cdev(ThermometerDevice *dev);
 
+/// @brief Tells linux that the state node is ready for use
+/// @param[in] dev the device that was created
+/// @return 0 on success, -E otherwise
+static int thermometer_setup_state_cdev(ThermometerDevice *dev);
+
+/// @brief Tells linux that the flight recorder node is ready for use
+/// @param[in] dev the device that was created
+/// @return 0 on success, -E otherwise
+static int thermometer_setup_flight_cdev(ThermometerDevice *dev);
+
+/// @brief Tells linux that the stream node is ready for use
+/// @param[in] dev the device that was created
+/// @return 0 on success, -E otherwise
+static int thermometer_setup_stream_cdev(ThermometerDevice *dev);
+
 /// @brief Performs the initialization for the device
 /// @return 0 on success, -E otherwise
 int thermometer_init_module(void);
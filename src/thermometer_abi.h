@@ -0,0 +1,223 @@
+/// @file thermometer_abi.h
+/// @brief Data layouts shared between the thermometer driver and user space
+///
+/// @author Sean Sweet
+/// @date 2025-4-7
+
+#ifndef THERMOMETER_ABI_H
+#define THERMOMETER_ABI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define THERMOMETER_RING_VERSION 7U
+
+#define THERMOMETER_STATE_MAGIC 0x534d4854U // "THMS"
+#define THERMOMETER_STATE_VERSION 3U
+
+/// @brief The constants used to turn a charge time into a temperature.
+/// @note resistance = charge_time / time_divisor + resistance_offset, and
+/// temperature = ((resistance / 10) * slope + intercept) / scale
+typedef struct ThermometerCalibration
+{
+    __u32 time_divisor;
+    __s32 resistance_offset;
+    __s32 slope;
+    __s32 intercept;
+    __s32 scale;
+    __u32 reserved;
+} ThermometerCalibration;
+
+/// @brief What caused a sample to be taken
+enum ThermometerTrigger
+{
+    THERMOMETER_TRIGGER_OPEN = 0,      // an open of /dev/thermometer
+    THERMOMETER_TRIGGER_PERIODIC = 1,  // the sampler's monotonic interval timer
+    THERMOMETER_TRIGGER_ALIGNED = 2,   // the sampler's timer aligned to CLOCK_REALTIME boundaries
+    THERMOMETER_TRIGGER_EXTERNAL = 3,  // an edge on the external trigger GPIO
+};
+
+/// @brief Health of the sensor, from best to worst
+enum ThermometerHealthState
+{
+    THERMOMETER_HEALTH_OK = 0,
+    THERMOMETER_HEALTH_DRIFTING = 1,  // the long term charge time moved away from the baseline
+    THERMOMETER_HEALTH_NOISY = 2,     // the charge time varies more than health_noise_ppm
+    THERMOMETER_HEALTH_STUCK = 3,     // the charge time hasn't moved for health_stuck_ms
+    THERMOMETER_HEALTH_FAILING = 4,   // too many charges time out
+};
+
+#define THERMOMETER_SAMPLE_HEALTH_CHANGED 0x0001U  // the health state changed with this sample
+#define THERMOMETER_SAMPLE_FREQ_CHANGED 0x0002U    // the CPU frequency changed during the charge
+#define THERMOMETER_SAMPLE_RAW 0x0004U             // the temperature wasn't converted, only charge_time is valid
+
+/// @brief Incrementally tracked sensor health metrics
+typedef struct ThermometerHealth
+{
+    __u32 state;            // enum ThermometerHealthState
+    __u32 transitions;      // number of state changes since load
+    __u32 mean_charge_time; // short term average charge time, in ns
+    __u32 noise_ppm;        // short term standard deviation relative to the mean
+    __u32 drift_ppm;        // long term average relative to the baseline
+    __u32 timeout_ppm;      // share of recent charges that timed out
+    __u64 stuck_duration;   // time the charge time has been within health_stuck_ppm, in ns
+    __u64 baseline_charge_time;
+    __u32 irq_restarts;     // times the watchdog re-requested the edge IRQ
+    __u32 reserved;
+} ThermometerHealth;
+
+/// @brief A single measurement as published by the driver
+/// @note the size is kept a power of 2 so that the ring holds a whole number of samples per page
+typedef struct ThermometerSample
+{
+    __u64 timestamp;        // CLOCK_MONOTONIC time of the rising edge, in ns
+    __u32 charge_time;      // time it took the capacitor to charge, in ns
+    __s32 temperature;      // converted temperature, in degrees C
+    __u32 trigger_latency;  // time from the trigger to the start of the charge, in ns
+    __u16 trigger;          // enum ThermometerTrigger
+    __u16 flags;            // THERMOMETER_SAMPLE_*
+    __u64 reserved;
+} ThermometerSample;
+
+/// @brief The first page of the memory mapped sample ring.
+/// @note The page can be mapped on its own to learn the size of the whole mapping, data_offset +
+/// data_size.  The sample data starts at data_offset bytes from the start of the mapping and holds
+/// data_size / sizeof(ThermometerSample) entries.  data_head is the number of samples the driver
+/// has ever published, the driver keeps its own copy and only ever writes it here.  The ring is
+/// mapped read only.  The ring overwrites the oldest samples, so a reader that falls more than a
+/// full ring behind has lost the samples in between.
+///
+/// The consumer's ThermometerRingTail is a separate writable page, mapped at mmap offset
+/// tail_offset.  The consumer stores the number of samples it has consumed there so that poll()
+/// knows when to wake it up.  There is a single tail, so only one process should consume the ring
+/// through poll(), e.g. thermometer_broker, and other readers should go through it or the stream
+/// node.
+///
+/// stale is non-zero while the sampler's watchdog considers the newest sample out of date, it is
+/// cleared by the next published sample.
+///
+/// health is updated with every measurement attempt, a change of state is also flagged on the
+/// sample that caused it.
+///
+/// The offsets_* fields map sample timestamps to other clocks, e.g.
+/// CLOCK_REALTIME = timestamp + offset_real.  They are refreshed on every publish and guarded by
+/// offsets_seq: it is odd while the driver updates them, so a reader retries until it reads the
+/// same even value before and after copying the offsets.
+typedef struct ThermometerRingPage
+{
+    __u32 version;
+    __u32 sample_size;
+    __u64 data_offset;
+    __u64 data_size;
+    __u64 data_head;
+    __u64 tail_offset;   // mmap offset of the ThermometerRingTail page
+    __u32 offsets_seq;
+    __u32 stale;
+    __s64 offset_boot;
+    __s64 offset_real;
+    __s64 offset_tai;
+    ThermometerHealth health;
+} ThermometerRingPage;
+
+/// @brief The page the ring's consumer writes, mapped read-write at tail_offset
+typedef struct ThermometerRingTail
+{
+    __u64 data_tail;
+} ThermometerRingTail;
+
+#define THERMOMETER_IOC_MAGIC 'T'
+
+/// @brief A time range of the sample ring, for THERMOMETER_IOC_FIND and THERMOMETER_IOC_READ_RANGE
+/// @note from and to are sample timestamps, to is exclusive.  The driver sets sequence to the
+/// data_head number of the oldest sample in the ring taken at or after from, or to data_head if
+/// there is none.  For THERMOMETER_IOC_READ_RANGE, buffer points at room for count samples and the
+/// driver sets count to the number it copied there, oldest first.  The lookup is a binary search
+/// over the samples published since the last warm start import, earlier ones are not found by time.
+typedef struct ThermometerRange
+{
+    __u64 from;
+    __u64 to;
+    __u64 sequence;
+    __u64 buffer;      // user pointer to ThermometerSample[count]
+    __u32 count;
+    __u32 reserved;
+} ThermometerRange;
+
+/// Finds sequence for from.  On /dev/thermometer_stream it also moves the reader there, so the
+/// following reads return the samples since from.
+#define THERMOMETER_IOC_FIND _IOWR(THERMOMETER_IOC_MAGIC, 1, ThermometerRange)
+/// Finds sequence for from and copies the samples from there until to
+#define THERMOMETER_IOC_READ_RANGE _IOWR(THERMOMETER_IOC_MAGIC, 2, ThermometerRange)
+/// Runs the given __u64 number of ms of virtual time of sampling on a simulated device, returning
+/// when done.  Needs CAP_SYS_ADMIN.
+#define THERMOMETER_IOC_SIMULATE_ADVANCE _IOW(THERMOMETER_IOC_MAGIC, 3, __u64)
+
+/// @brief The health and nowcast filter state carried by a warm start blob, so that both carry on
+/// converged instead of starting over.  All 0 when the features are disabled or had no samples yet.
+/// @note times are CLOCK_MONOTONIC of the exporting boot
+typedef struct ThermometerStateFilters
+{
+    __u64 health_samples;
+    __u64 health_mean;          // short term average charge time in ns
+    __u64 health_variance;      // short term variance in ns^2
+    __u64 health_slow_mean;     // long term average charge time in ns
+    __u64 health_baseline;      // drift baseline charge time in ns, 0 until taken
+    __u32 health_timeout_ppm;
+    __u32 nowcast_samples;
+    __s64 nowcast_level;        // filtered charge time at nowcast_time in ns
+    __s64 nowcast_trend;        // in ns per second
+    __u64 nowcast_residual;
+    __u64 nowcast_interval;
+    __u64 nowcast_time;
+} ThermometerStateFilters;
+
+/// @brief Header of the warm start blob read from and written to /dev/thermometer_state.
+/// @note The header is followed by sample_count samples, oldest first.  size is the length of
+/// the whole blob including the header.
+typedef struct ThermometerStateHeader
+{
+    __u32 magic;
+    __u32 version;
+    __u32 size;
+    __u32 sample_count;
+    ThermometerCalibration calibration;
+    ThermometerSample last_sample;
+    ThermometerStateFilters filters;
+} ThermometerStateHeader;
+
+#define THERMOMETER_FLIGHT_MAGIC 0x544c4654U // "TFLT"
+#define THERMOMETER_FLIGHT_VERSION 1U
+
+/// @brief What a flight recorder entry describes
+enum ThermometerFlightKind
+{
+    THERMOMETER_FLIGHT_SAMPLE = 0,   // a published sample
+    THERMOMETER_FLIGHT_HEALTH = 1,   // a health state change, detail is the new state
+    THERMOMETER_FLIGHT_TIMEOUT = 2,  // a charge that timed out
+};
+
+/// @brief One 8 byte entry of the flight recorder
+typedef struct ThermometerFlightRecord
+{
+    __u32 time_ms;       // CLOCK_MONOTONIC time in ms, wraps after 49 days
+    __s16 temperature;   // degrees C
+    __u8 kind;           // enum ThermometerFlightKind
+    __u8 detail;
+} ThermometerFlightRecord;
+
+/// @brief Header of the persistent flight recorder region, also the header of what
+/// /dev/thermometer_flight returns.
+/// @note In the region the capacity records follow the header and next is the slot the next
+/// record goes to.  What the node returns is the region as it was found at load, with the count
+/// records reordered oldest first.
+typedef struct ThermometerFlightHeader
+{
+    __u32 magic;
+    __u32 version;
+    __u32 boot;        // incremented on every load, tells the recovered trace from the current one
+    __u32 capacity;
+    __u32 count;       // number of valid records, at most capacity
+    __u32 next;
+} ThermometerFlightHeader;
+
+#endif // THERMOMETER_ABI_H
@@ -0,0 +1,90 @@
+/// @file thermometer_bcm2835.h
+/// @brief Direct access to the BCM2835 GPIO level, set and clear registers
+///
+/// Shared by the driver, which maps the real registers, and the host tools, which point it at a
+/// simulated register window, so that the fast path's logic and loop rate can be checked off
+/// target.  Only pins 0-31 are supported, they live in the first bank of each register.
+
+#ifndef THERMOMETER_BCM2835_H
+#define THERMOMETER_BCM2835_H
+
+#include <linux/types.h>
+
+#ifdef __KERNEL__
+#include <linux/io.h>
+#endif
+
+#define THERMOMETER_BCM2835_GPIO_BASE 0x20200000UL  // BCM2835 (Pi Zero) physical address
+#define THERMOMETER_BCM2835_GPIO_SIZE 0xb4UL
+
+#define THERMOMETER_BCM2835_GPSET0 0x1cU  // writing 1 drives an output pin high
+#define THERMOMETER_BCM2835_GPCLR0 0x28U  // writing 1 drives an output pin low
+#define THERMOMETER_BCM2835_GPLEV0 0x34U  // the level of every pin
+
+#ifdef __KERNEL__
+typedef void __iomem *ThermometerBcm2835Regs;
+
+static inline __u32 thermometer_bcm2835_read(ThermometerBcm2835Regs regs, unsigned int offset)
+{
+    // the level poll needs no ordering against other accesses, the barrier of readl would only slow it
+    return readl_relaxed(regs + offset);
+}
+
+static inline void thermometer_bcm2835_write(ThermometerBcm2835Regs regs, unsigned int offset, __u32 value)
+{
+    writel(value, regs + offset);
+}
+#else
+typedef volatile void *ThermometerBcm2835Regs;
+
+static inline __u32 thermometer_bcm2835_read(ThermometerBcm2835Regs regs, unsigned int offset)
+{
+    return *(volatile __u32 *)((volatile char *)regs + offset);
+}
+
+static inline void thermometer_bcm2835_write(ThermometerBcm2835Regs regs, unsigned int offset, __u32 value)
+{
+    *(volatile __u32 *)((volatile char *)regs + offset) = value;
+}
+#endif
+
+/// @brief Drives an output pin
+/// @param[in] regs the mapped GPIO registers
+/// @param[in] pin the BCM GPIO number, below 32
+/// @param[in] value 0 for low, anything else for high
+static inline void thermometer_bcm2835_set_level(ThermometerBcm2835Regs regs, unsigned int pin, int value)
+{
+    thermometer_bcm2835_write(regs, value ? THERMOMETER_BCM2835_GPSET0 : THERMOMETER_BCM2835_GPCLR0, 1U << pin);
+}
+
+/// @brief Reads the level of a pin
+/// @param[in] regs the mapped GPIO registers
+/// @param[in] pin the BCM GPIO number, below 32
+/// @return 1 if the pin is high, 0 otherwise
+static inline int thermometer_bcm2835_get_level(ThermometerBcm2835Regs regs, unsigned int pin)
+{
+    return (thermometer_bcm2835_read(regs, THERMOMETER_BCM2835_GPLEV0) >> pin) & 1U;
+}
+
+/// @brief Polls a pin until it goes high, for at most a given number of reads
+/// @note the caller checks its deadline between calls, keeping the clock out of the loop
+/// @param[in] regs the mapped GPIO registers
+/// @param[in] pin the BCM GPIO number, below 32
+/// @param[in] polls the maximum number of reads
+/// @return the number of reads it took for the pin to be seen high, 0 if it stayed low
+static inline unsigned int thermometer_bcm2835_wait_high(ThermometerBcm2835Regs regs, unsigned int pin,
+                                                         unsigned int polls)
+{
+    __u32 mask = 1U << pin;
+    unsigned int i;
+
+    for (i = 1; i <= polls; i++)
+    {
+        if (thermometer_bcm2835_read(regs, THERMOMETER_BCM2835_GPLEV0) & mask)
+            return i;
+    }
+
+    return 0;
+}
+
+#endif // THERMOMETER_BCM2835_H
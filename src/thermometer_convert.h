@@ -0,0 +1,83 @@
+/// @file thermometer_convert.h
+/// @brief Charge time conversions shared by the driver and the host tools
+///
+/// Everything here is integer only and builds both in the kernel and in user space, so the tools
+/// reproduce the driver's results bit for bit.
+
+#ifndef THERMOMETER_CONVERT_H
+#define THERMOMETER_CONVERT_H
+
+#include "thermometer_abi.h"
+
+#ifdef __KERNEL__
+#include <linux/math64.h>
+#endif
+
+/// @brief One point of a generated R-T table, the segment up to the next entry has the given slope
+typedef struct ThermometerLutEntry
+{
+    __s32 resistance;    // ohms
+    __s32 temperature;   // millidegrees C
+    __s32 slope;         // millidegrees C per ohm, Q16
+} ThermometerLutEntry;
+
+/// @brief resistance = charge_time / time_divisor + resistance_offset
+/// @param[in] calibration the calibration constants to use
+/// @param[in] charge_time the charge time in ns
+/// @return the resistance in ohms
+static inline int thermometer_convert_resistance(const ThermometerCalibration *calibration, __u64 charge_time)
+{
+#ifdef __KERNEL__
+    return div_u64(charge_time, calibration->time_divisor) + calibration->resistance_offset;
+#else
+    return (int)(charge_time / calibration->time_divisor) + calibration->resistance_offset;
+#endif
+}
+
+/// @brief temperature = ((resistance / 10) * slope + intercept) / scale
+/// @param[in] calibration the calibration constants to use
+/// @param[in] resistance the resistance in ohms
+/// @return the temperature in degrees C
+static inline int thermometer_convert_linear(const ThermometerCalibration *calibration, int resistance)
+{
+    // the ratio between the current resistance, and the resistance at 25C, times 1000
+    int relative_resistance = resistance / 10;
+
+    return (relative_resistance * calibration->slope + calibration->intercept) / calibration->scale;
+}
+
+/// @brief Interpolates a generated R-T table with a binary search and a single multiply
+/// @note resistances outside the table are clamped to its ends
+/// @param[in] lut the table, sorted by resistance
+/// @param[in] entries the number of entries in the table, at least 2
+/// @param[in] resistance the resistance in ohms
+/// @return the temperature in millidegrees C
+static inline int thermometer_convert_lut(const ThermometerLutEntry *lut, unsigned int entries, int resistance)
+{
+    unsigned int low = 0;
+    unsigned int high = entries - 1;
+    const ThermometerLutEntry *entry;
+
+    if (resistance <= lut[0].resistance)
+        return lut[0].temperature;
+
+    if (resistance >= lut[high].resistance)
+        return lut[high].temperature;
+
+    // find the last entry at or below the resistance
+    while (high - low > 1)
+    {
+        unsigned int middle = (low + high) / 2;
+
+        if (lut[middle].resistance <= resistance)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    entry = &lut[low];
+
+    return entry->temperature + (__s32)(((__s64)(resistance - entry->resistance) * entry->slope) >> 16);
+}
+
+#endif // THERMOMETER_CONVERT_H
@@ -0,0 +1,577 @@
+/// @file thermometer_bench.cpp
+/// @brief Host benchmark of the conversion and filter variants against a floating point reference
+///
+/// Every conversion turns charge times into temperatures, the integer ones through the same
+/// thermometer_convert.h code the driver runs.  They are timed over synthetic datasets generated
+/// from the thermistor's R-T table (and any recorded "charge_time_ns,reference_temperature_c"
+/// logs given on the command line) and compared against the R-T table evaluated in double
+/// precision on the unrounded resistance.  The filters run on the output of the table lookup
+/// and are compared against the true temperature of each sample.  Recorded logs are converted
+/// with the driver's default time calibration, or the one of the state blob given with --profile.
+/// Finally the thermometer_bulk.h implementations convert --bulk raw charge times, which are
+/// checked against the scalar conversion and timed.
+///
+/// usage: thermometer_bench [--rt-csv table.csv] [--samples N] [--repeat N] [--profile board.bin]
+///                          [--bulk N] [records.csv...]
+
+#include "../src/thermometer_abi.h"
+#include "../src/thermometer_convert.h"
+#include "thermometer_bench_lut.h"
+#include "thermometer_bulk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+/// @brief The charge time to resistance half of the calibration used for the synthetic data.
+/// @note The offset is 0 so that the hot end of the table, below the driver's 8000 ohm, still
+/// maps to positive charge times.
+const ThermometerCalibration bench_time_calibration = {50000, 0, 0, 0, 1, 0};
+
+/// @brief The driver's default calibration, assumed for recorded logs unless --profile is given
+const ThermometerCalibration default_calibration = {50000, 8000, -18, 55685, 463, 0};
+
+struct RtPoint
+{
+    double temperature;
+    double resistance;
+};
+
+struct Dataset
+{
+    std::string name;
+    std::vector<uint64_t> charge_times;
+    std::vector<double> truth;   // true temperature of each sample
+    ThermometerCalibration time_calibration;
+};
+
+struct Result
+{
+    double ns_per_sample;
+    double mean_error;
+    double max_error;
+};
+
+volatile int64_t sink;
+
+bool read_rt_table(const std::string &path, std::vector<RtPoint> &points)
+{
+    std::ifstream file(path);
+    std::string line;
+    double temperature, resistance;
+    char comma;
+
+    if (!file)
+    {
+        std::cerr << "Can't open " << path << "\n";
+        return false;
+    }
+
+    while (std::getline(file, line))
+    {
+        std::istringstream stream(line);
+
+        if (stream >> temperature >> comma >> resistance && comma == ',' && resistance > 0.0)
+            points.push_back({temperature, resistance});
+    }
+
+    std::sort(points.begin(), points.end(),
+              [](const RtPoint &a, const RtPoint &b) { return a.temperature < b.temperature; });
+
+    return points.size() >= 2;
+}
+
+bool read_profile(const std::string &path, ThermometerCalibration &calibration)
+{
+    ThermometerStateHeader header;
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != THERMOMETER_STATE_MAGIC ||
+        header.version != THERMOMETER_STATE_VERSION || header.calibration.time_divisor == 0)
+    {
+        std::cerr << path << " is not a thermometer state blob\n";
+        return false;
+    }
+
+    calibration = header.calibration;
+    return true;
+}
+
+bool read_records(const std::string &path, const ThermometerCalibration &calibration, Dataset &dataset)
+{
+    std::ifstream file(path);
+    std::string line;
+    double charge_time, temperature;
+    char comma;
+
+    if (!file)
+    {
+        std::cerr << "Can't open " << path << "\n";
+        return false;
+    }
+
+    dataset.name = path;
+    dataset.time_calibration = calibration;
+    while (std::getline(file, line))
+    {
+        std::istringstream stream(line);
+
+        if (stream >> charge_time >> comma >> temperature && comma == ',' && charge_time > 0.0)
+        {
+            dataset.charge_times.push_back(static_cast<uint64_t>(charge_time));
+            dataset.truth.push_back(temperature);
+        }
+    }
+
+    return !dataset.charge_times.empty();
+}
+
+double table_resistance(const std::vector<RtPoint> &points, double temperature)
+{
+    size_t i = 1;
+
+    while (i < points.size() - 1 && points[i].temperature < temperature)
+        i++;
+
+    double fraction = (temperature - points[i - 1].temperature) /
+                      (points[i].temperature - points[i - 1].temperature);
+
+    return std::exp(std::log(points[i - 1].resistance) +
+                    fraction * (std::log(points[i].resistance) - std::log(points[i - 1].resistance)));
+}
+
+double table_temperature(const std::vector<RtPoint> &points, double resistance)
+{
+    size_t i = 1;
+
+    while (i < points.size() - 1 && points[i].resistance > resistance)
+        i++;
+
+    double fraction = (std::log(resistance) - std::log(points[i - 1].resistance)) /
+                      (std::log(points[i].resistance) - std::log(points[i - 1].resistance));
+
+    return points[i - 1].temperature + fraction * (points[i].temperature - points[i - 1].temperature);
+}
+
+/// @brief Generates charge times for a temperature trajectory with gaussian timing noise
+Dataset synthesize(const std::string &name, const std::vector<RtPoint> &table, size_t samples,
+                   const std::function<double(double)> &trajectory, double noise)
+{
+    std::mt19937_64 generator(42);
+    std::normal_distribution<double> jitter(0.0, 1.0);
+    Dataset dataset;
+
+    dataset.name = name;
+    dataset.time_calibration = bench_time_calibration;
+    for (size_t i = 0; i < samples; i++)
+    {
+        double temperature = trajectory(static_cast<double>(i) / samples);
+        double resistance = table_resistance(table, temperature);
+        double charge_time = (resistance - bench_time_calibration.resistance_offset) *
+                             bench_time_calibration.time_divisor;
+
+        charge_time *= 1.0 + noise * jitter(generator);
+        dataset.charge_times.push_back(static_cast<uint64_t>(std::max(charge_time, 0.0)));
+        dataset.truth.push_back(temperature);
+    }
+
+    return dataset;
+}
+
+/// @brief Fits the linear conversion to the table over the room temperature range it is meant for
+ThermometerCalibration fit_linear(const std::vector<RtPoint> &table)
+{
+    ThermometerCalibration calibration = bench_time_calibration;
+    double sum_r = 0.0, sum_t = 0.0, sum_rr = 0.0, sum_rt = 0.0, n = 0.0;
+
+    for (double temperature = 15.0; temperature <= 35.0; temperature += 0.5)
+    {
+        double resistance = table_resistance(table, temperature);
+
+        sum_r += resistance;
+        sum_t += temperature;
+        sum_rr += resistance * resistance;
+        sum_rt += resistance * temperature;
+        n += 1.0;
+    }
+
+    double slope = (n * sum_rt - sum_r * sum_t) / (n * sum_rr - sum_r * sum_r);
+    double intercept = (sum_t - slope * sum_r) / n;
+
+    calibration.scale = 10000;
+    calibration.slope = static_cast<int32_t>(std::lround(slope * 10.0 * calibration.scale));
+    calibration.intercept = static_cast<int32_t>(std::lround(intercept * calibration.scale));
+
+    return calibration;
+}
+
+/// @brief Steinhart-Hart 1/T = A + B ln(R) + C ln(R)^3 through three points of the table
+struct SteinhartHart
+{
+    double a, b, c;
+
+    explicit SteinhartHart(const std::vector<RtPoint> &table)
+    {
+        double l1 = std::log(table_resistance(table, 0.0));
+        double l2 = std::log(table_resistance(table, 25.0));
+        double l3 = std::log(table_resistance(table, 50.0));
+        double y1 = 1.0 / 273.15, y2 = 1.0 / 298.15, y3 = 1.0 / 323.15;
+        double g2 = (y2 - y1) / (l2 - l1);
+        double g3 = (y3 - y1) / (l3 - l1);
+
+        c = (g3 - g2) / (l3 - l2) / (l1 + l2 + l3);
+        b = g2 - c * (l1 * l1 + l1 * l2 + l2 * l2);
+        a = y1 - (b + l1 * l1 * c) * l1;
+    }
+};
+
+template <typename Convert>
+Result run_conversion(const Dataset &dataset, const std::vector<RtPoint> &table, int repeat, Convert convert)
+{
+    Result result = {};
+    int64_t accumulator = 0;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++)
+    {
+        for (uint64_t charge_time : dataset.charge_times)
+            accumulator += convert(charge_time);
+    }
+    auto end = std::chrono::steady_clock::now();
+    sink = accumulator;
+
+    result.ns_per_sample = std::chrono::duration<double, std::nano>(end - begin).count() /
+                           (static_cast<double>(dataset.charge_times.size()) * repeat);
+
+    for (uint64_t charge_time : dataset.charge_times)
+    {
+        double resistance = static_cast<double>(charge_time) / dataset.time_calibration.time_divisor +
+                            dataset.time_calibration.resistance_offset;
+        double error = std::fabs(convert(charge_time) / 1000.0 - table_temperature(table, resistance));
+
+        result.mean_error += error;
+        result.max_error = std::max(result.max_error, error);
+    }
+    result.mean_error /= dataset.charge_times.size();
+
+    return result;
+}
+
+/// @brief Exponentially weighted moving average with a weight of 1 / 2^shift
+struct EwmaFilter
+{
+    int shift;
+    int64_t state = 0;
+    bool primed = false;
+
+    explicit EwmaFilter(int weight_shift = 2) : shift(weight_shift) {}
+
+    int32_t operator()(int32_t value)
+    {
+        if (!primed)
+        {
+            state = static_cast<int64_t>(value) << shift;
+            primed = true;
+        }
+        state += value - (state >> shift);
+        return static_cast<int32_t>(state >> shift);
+    }
+};
+
+struct SlowEwmaFilter : EwmaFilter
+{
+    SlowEwmaFilter() : EwmaFilter(4) {}
+};
+
+/// @brief Moving average over the last 8 samples
+struct MovingAverageFilter
+{
+    int32_t window[8] = {};
+    int64_t sum = 0;
+    unsigned int count = 0;
+
+    int32_t operator()(int32_t value)
+    {
+        unsigned int slot = count & 7U;
+
+        sum += value - window[slot];
+        window[slot] = value;
+        count++;
+        return static_cast<int32_t>(sum / std::min(count, 8U));
+    }
+};
+
+/// @brief Median of the last 5 samples
+struct MedianFilter
+{
+    int32_t window[5] = {};
+    unsigned int count = 0;
+
+    int32_t operator()(int32_t value)
+    {
+        int32_t sorted[5];
+        unsigned int filled;
+
+        window[count % 5] = value;
+        count++;
+        filled = std::min(count, 5U);
+        std::copy(window, window + filled, sorted);
+        std::sort(sorted, sorted + filled);
+        return sorted[filled / 2];
+    }
+};
+
+struct PassthroughFilter
+{
+    int32_t operator()(int32_t value) { return value; }
+};
+
+template <typename Filter>
+Result run_filter(const Dataset &dataset, const std::vector<int32_t> &input, int repeat)
+{
+    Result result = {};
+    int64_t accumulator = 0;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++)
+    {
+        Filter filter;
+        for (int32_t value : input)
+            accumulator += filter(value);
+    }
+    auto end = std::chrono::steady_clock::now();
+    sink = accumulator;
+
+    result.ns_per_sample = std::chrono::duration<double, std::nano>(end - begin).count() /
+                           (static_cast<double>(input.size()) * repeat);
+
+    Filter filter;
+    for (size_t i = 0; i < input.size(); i++)
+    {
+        double error = std::fabs(filter(input[i]) / 1000.0 - dataset.truth[i]);
+
+        result.mean_error += error;
+        result.max_error = std::max(result.max_error, error);
+    }
+    result.mean_error /= input.size();
+
+    return result;
+}
+
+void print_result(const char *name, size_t bytes, const Result &result)
+{
+    std::printf("  %-24s %10.2f %10zu %12.3f %12.3f\n", name, result.ns_per_sample, bytes, result.mean_error,
+                result.max_error);
+}
+
+/// @brief Times each bulk conversion the CPU runs over count charge times of the given calibration
+bool run_bulk(const ThermometerCalibration &calibration, size_t count, int repeat)
+{
+    static const struct
+    {
+        ThermometerBulkPath path;
+        const char *name;
+    } paths[] = {
+        {THERMOMETER_BULK_SCALAR, "scalar"},
+        {THERMOMETER_BULK_SSE2, "sse2"},
+        {THERMOMETER_BULK_AVX, "avx"},
+        {THERMOMETER_BULK_NEON, "neon"},
+    };
+    std::mt19937 generator(7);
+    // charge times across the full range, and past it to cover the clamped and extreme values
+    std::uniform_int_distribution<uint32_t> distribution(0, 2000000000U);
+    std::vector<__u32> charge_times(count);
+    std::vector<__s32> reference(count);
+    std::vector<__s32> temperatures(count);
+    bool ok = true;
+
+    for (__u32 &charge_time : charge_times)
+        charge_time = distribution(generator);
+    charge_times[0] = 0;
+    if (count > 1)
+        charge_times[1] = UINT32_MAX / 2;
+
+    thermometer_bulk_convert_scalar(&calibration, charge_times.data(), reference.data(), count);
+
+    std::printf("\nbulk conversion (%zu charge times)\n", count);
+    std::printf("  %-24s %10s %10s %12s\n", "path", "ns/sample", "GB/s", "mismatches");
+
+    for (const auto &entry : paths)
+    {
+        if (!thermometer_bulk_path_supported(entry.path))
+            continue;
+
+        // an odd count leaves a tail for the scalar fallback
+        size_t converted = count - (count > 1 ? 1 : 0);
+        double best = 0.0;
+
+        for (int r = 0; r < repeat; r++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            thermometer_bulk_convert_with(entry.path, &calibration, charge_times.data(), temperatures.data(), converted);
+            double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            best = r == 0 ? elapsed : std::min(best, elapsed);
+        }
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < converted; i++)
+            mismatches += temperatures[i] != reference[i];
+
+        std::printf("  %-24s %10.3f %10.2f %12zu\n", entry.name, best / converted,
+                    converted * (sizeof(__u32) + sizeof(__s32)) / best, mismatches);
+        ok &= mismatches == 0;
+    }
+
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::string rt_csv_path = "../data/ntc_10k_b3950.csv";
+    size_t samples = 100000;
+    int repeat = 20;
+    size_t bulk_samples = 16 * 1024 * 1024;
+    std::vector<std::string> record_paths;
+    ThermometerCalibration record_calibration = default_calibration;
+    std::vector<RtPoint> table;
+    std::vector<Dataset> datasets;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+
+        if (argument == "--rt-csv" && i + 1 < argc)
+            rt_csv_path = argv[++i];
+        else if (argument == "--samples" && i + 1 < argc)
+            samples = std::strtoul(argv[++i], nullptr, 10);
+        else if (argument == "--bulk" && i + 1 < argc)
+            bulk_samples = std::strtoul(argv[++i], nullptr, 10);
+        else if (argument == "--repeat" && i + 1 < argc)
+            repeat = std::atoi(argv[++i]);
+        else if (argument == "--profile" && i + 1 < argc)
+        {
+            if (!read_profile(argv[++i], record_calibration))
+                return 1;
+        }
+        else if (argument[0] != '-')
+            record_paths.push_back(argument);
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--rt-csv table.csv] [--samples N] [--repeat N] [--profile board.bin]\n"
+                      << "       [--bulk N] [records.csv...]\n";
+            return 1;
+        }
+    }
+
+    if (samples == 0 || repeat <= 0)
+    {
+        std::cerr << "--samples and --repeat must be positive\n";
+        return 1;
+    }
+
+    if (!read_rt_table(rt_csv_path, table))
+    {
+        std::cerr << rt_csv_path << " needs at least 2 temperature,resistance points\n";
+        return 1;
+    }
+
+    datasets.push_back(synthesize("steady 25C", table, samples, [](double) { return 25.0; }, 0.002));
+    datasets.push_back(synthesize("ramp 10C to 40C", table, samples, [](double x) { return 10.0 + 30.0 * x; }, 0.002));
+    datasets.push_back(synthesize("step 20C to 30C", table, samples, [](double x) { return x < 0.5 ? 20.0 : 30.0; },
+                                  0.002));
+    datasets.push_back(synthesize("wide -20C to 100C", table, samples,
+                                  [](double x) { return 40.0 + 60.0 * std::sin(6.283185307 * x); }, 0.002));
+
+    for (const std::string &path : record_paths)
+    {
+        Dataset dataset;
+        if (!read_records(path, record_calibration, dataset))
+        {
+            std::cerr << path << " has no charge_time_ns,reference_temperature_c records\n";
+            return 1;
+        }
+        datasets.push_back(dataset);
+    }
+
+    const ThermometerCalibration linear_fit = fit_linear(table);
+    // the time to resistance half of both is switched to each dataset's before running it
+    ThermometerCalibration linear = linear_fit;
+    ThermometerCalibration time_calibration = bench_time_calibration;
+    const SteinhartHart steinhart_hart(table);
+    const float sh_a = static_cast<float>(steinhart_hart.a);
+    const float sh_b = static_cast<float>(steinhart_hart.b);
+    const float sh_c = static_cast<float>(steinhart_hart.c);
+
+    // all conversions return millidegrees
+    auto convert_linear = [&linear](uint64_t charge_time) -> int32_t {
+        return thermometer_convert_linear(&linear, thermometer_convert_resistance(&linear, charge_time)) * 1000;
+    };
+    auto convert_lut = [&time_calibration](uint64_t charge_time) -> int32_t {
+        return thermometer_convert_lut(thermometer_lut, THERMOMETER_LUT_ENTRIES,
+                                       thermometer_convert_resistance(&time_calibration, charge_time));
+    };
+    auto convert_sh_double = [&steinhart_hart, &time_calibration](uint64_t charge_time) -> int32_t {
+        double l = std::log(static_cast<double>(thermometer_convert_resistance(&time_calibration, charge_time)));
+        return static_cast<int32_t>(
+            std::lround((1.0 / (steinhart_hart.a + steinhart_hart.b * l + steinhart_hart.c * l * l * l) - 273.15) *
+                        1000.0));
+    };
+    auto convert_sh_float = [sh_a, sh_b, sh_c, &time_calibration](uint64_t charge_time) -> int32_t {
+        float l = std::log(static_cast<float>(thermometer_convert_resistance(&time_calibration, charge_time)));
+        return static_cast<int32_t>(std::lround((1.0f / (sh_a + sh_b * l + sh_c * l * l * l) - 273.15f) * 1000.0f));
+    };
+
+    std::printf("R-T table: %s, %zu samples per dataset, %d repeats\n", rt_csv_path.c_str(), samples, repeat);
+
+    for (const Dataset &dataset : datasets)
+    {
+        time_calibration = dataset.time_calibration;
+        linear.time_divisor = dataset.time_calibration.time_divisor;
+        linear.resistance_offset = dataset.time_calibration.resistance_offset;
+
+        std::printf("\n%s (%zu samples)\n", dataset.name.c_str(), dataset.charge_times.size());
+        std::printf("  %-24s %10s %10s %12s %12s\n", "conversion", "ns/sample", "bytes", "mean err C", "max err C");
+        print_result("integer linear", sizeof(ThermometerCalibration),
+                     run_conversion(dataset, table, repeat, convert_linear));
+        print_result("lookup table", sizeof(thermometer_lut), run_conversion(dataset, table, repeat, convert_lut));
+        print_result("steinhart-hart double", 3 * sizeof(double),
+                     run_conversion(dataset, table, repeat, convert_sh_double));
+        print_result("steinhart-hart float", 3 * sizeof(float),
+                     run_conversion(dataset, table, repeat, convert_sh_float));
+
+        std::vector<int32_t> converted;
+        for (uint64_t charge_time : dataset.charge_times)
+            converted.push_back(convert_lut(charge_time));
+
+        std::printf("  %-24s %10s %10s %12s %12s\n", "filter (on lookup table)", "ns/sample", "bytes", "mean err C",
+                    "max err C");
+        print_result("none", 0, run_filter<PassthroughFilter>(dataset, converted, repeat));
+        print_result("ewma 1/4", sizeof(EwmaFilter), run_filter<EwmaFilter>(dataset, converted, repeat));
+        print_result("ewma 1/16", sizeof(SlowEwmaFilter), run_filter<SlowEwmaFilter>(dataset, converted, repeat));
+        print_result("moving average 8", sizeof(MovingAverageFilter),
+                     run_filter<MovingAverageFilter>(dataset, converted, repeat));
+        print_result("median 5", sizeof(MedianFilter), run_filter<MedianFilter>(dataset, converted, repeat));
+    }
+
+    if (bulk_samples > 0 && !run_bulk(record_calibration, bulk_samples, std::min(repeat, 5)))
+    {
+        std::cerr << "a bulk conversion differs from the scalar one\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,407 @@
+/// @file thermometer_broker.cpp
+/// @brief Fans the driver's sample ring out to local readers through POSIX shared memory
+///
+/// The broker maps /dev/thermometer's sample ring, sleeps in poll() until the driver publishes, and
+/// copies the new samples into the shared memory ring described in thermometer_broker.h. Readers
+/// map that ring and wait on its futex instead of each holding the device open. The calibration is
+/// taken from the header of /dev/thermometer_state so that readers can convert raw samples.
+///
+/// --simulate publishes synthetic samples every N ms instead, for trying readers without the
+/// driver. --follow runs as a reader of a running broker and prints "timestamp_ns temperature"
+/// lines like /dev/thermometer_stream.
+///
+/// usage: thermometer_broker [--device path] [--state path] [--name name] [--capacity N]
+///                           [--simulate MS]
+///        thermometer_broker --follow [--name name]
+
+#include "../src/thermometer_abi.h"
+#include "../src/thermometer_convert.h"
+#include "thermometer_broker.h"
+
+#include <poll.h>
+
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace
+{
+
+/// @brief The driver's default calibration, used when the state node can't be read
+const ThermometerCalibration default_calibration = {50000, 8000, -18, 55685, 463, 0};
+
+volatile sig_atomic_t stopping = 0;
+
+struct Options
+{
+    std::string device = "/dev/thermometer";
+    std::string state = "/dev/thermometer_state";
+    std::string name = THERMOMETER_BROKER_NAME;
+    unsigned int capacity = 4096;
+    int simulate_ms = 0;
+    bool follow = false;
+};
+
+void stop(int)
+{
+    stopping = 1;
+}
+
+/// @brief The shared memory ring as the broker writes it
+struct Broker
+{
+    ThermometerBrokerPage *page = nullptr;
+    ThermometerSample *samples = nullptr;
+    size_t size = 0;
+
+    bool create(const Options &options, const ThermometerCalibration &calibration)
+    {
+        size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        int fd;
+
+        size = thermometer_broker_size(options.capacity);
+
+        // a ring left behind by a broker that didn't exit cleanly is replaced, its readers see a
+        // ring that never advances until they reopen
+        shm_unlink(options.name.c_str());
+        fd = shm_open(options.name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0)
+        {
+            std::perror("Can't create the shared memory ring");
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+
+        void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            std::perror("Can't map the shared memory ring");
+            return false;
+        }
+
+        page = static_cast<ThermometerBrokerPage *>(mapping);
+        samples = reinterpret_cast<ThermometerSample *>(static_cast<char *>(mapping) + page_size);
+
+        page->version = THERMOMETER_BROKER_VERSION;
+        page->sample_size = sizeof(ThermometerSample);
+        page->capacity = options.capacity;
+        page->data_offset = page_size;
+        page->calibration = calibration;
+        page->broker_pid = static_cast<__u32>(getpid());
+        // readers check the magic last, once the rest of the header is valid
+        __atomic_store_n(&page->magic, THERMOMETER_BROKER_MAGIC, __ATOMIC_RELEASE);
+
+        return true;
+    }
+
+    void publish(const ThermometerSample &sample)
+    {
+        __u64 head = page->head;
+
+        // the slot must not be seen written before the previous head, readers of the sample a ring
+        // behind rely on it
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        samples[head & (page->capacity - 1)] = sample;
+        __atomic_store_n(&page->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    /// @brief Wakes the readers once per batch of samples
+    void wake()
+    {
+        __atomic_add_fetch(&page->futex, 1, __ATOMIC_RELEASE);
+        thermometer_broker_futex(&page->futex, FUTEX_WAKE, INT32_MAX, nullptr);
+    }
+
+    void destroy(const Options &options)
+    {
+        if (page == nullptr)
+            return;
+
+        // readers waiting on the futex see the broker is gone and stop waiting
+        __atomic_store_n(&page->broker_pid, 0U, __ATOMIC_RELEASE);
+        wake();
+        munmap(page, size);
+        shm_unlink(options.name.c_str());
+        page = nullptr;
+    }
+};
+
+ThermometerCalibration read_calibration(const std::string &path)
+{
+    ThermometerStateHeader header;
+    std::ifstream file(path, std::ios::binary);
+
+    if (file.read(reinterpret_cast<char *>(&header), sizeof(header)) && header.magic == THERMOMETER_STATE_MAGIC &&
+        header.calibration.time_divisor != 0 && header.calibration.scale != 0)
+        return header.calibration;
+
+    std::cerr << "Can't read the calibration from " << path << ", assuming the default\n";
+    return default_calibration;
+}
+
+/// @brief The size of the driver's ring mapping as its control page advertises it, 0 on error
+size_t ring_size(int fd, size_t page_size)
+{
+    void *mapping = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fd, 0);
+    size_t size = 0;
+
+    if (mapping == MAP_FAILED)
+    {
+        std::perror("Can't map the ring's control page");
+        return 0;
+    }
+
+    auto *ring = static_cast<const ThermometerRingPage *>(mapping);
+    if (ring->version != THERMOMETER_RING_VERSION || ring->sample_size != sizeof(ThermometerSample))
+        std::cerr << "The driver's ring version " << ring->version << " isn't supported\n";
+    else
+        size = ring->data_offset + ring->data_size;
+
+    munmap(mapping, page_size);
+
+    return size;
+}
+
+/// @brief Copies the driver's samples into the broker's ring until stopped
+bool run_device(const Options &options, Broker &broker)
+{
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+    int fd = open(options.device.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::perror(options.device.c_str());
+        return false;
+    }
+
+    size_t size = ring_size(fd, page_size);
+    if (size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        std::perror("Can't map the sample ring");
+        close(fd);
+        return false;
+    }
+
+    auto *ring = static_cast<const ThermometerRingPage *>(mapping);
+    void *tail_mapping = mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                              static_cast<off_t>(ring->tail_offset));
+    auto *tail = static_cast<ThermometerRingTail *>(tail_mapping);
+    const auto *samples = reinterpret_cast<const ThermometerSample *>(static_cast<char *>(mapping) +
+                                                                       ring->data_offset);
+    __u64 capacity = ring->data_size / sizeof(ThermometerSample);
+    __u64 cursor = __atomic_load_n(&ring->data_head, __ATOMIC_ACQUIRE);
+    __u64 lost = 0;
+    bool ok = true;
+
+    if (tail_mapping == MAP_FAILED)
+    {
+        std::perror("Can't map the ring's tail page");
+        ok = false;
+    }
+
+    while (ok && !stopping)
+    {
+        pollfd waiter = {fd, POLLIN, 0};
+
+        __atomic_store_n(&tail->data_tail, cursor, __ATOMIC_RELEASE);
+        if (poll(&waiter, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::perror("poll");
+            ok = false;
+            break;
+        }
+
+        __u64 head = __atomic_load_n(&ring->data_head, __ATOMIC_ACQUIRE);
+        bool published = false;
+
+        for (; cursor != head; cursor++)
+        {
+            if (head - cursor > capacity)
+            {
+                lost += head - capacity - cursor;
+                cursor = head - capacity;
+            }
+
+            ThermometerSample sample = samples[cursor & (capacity - 1)];
+
+            // the same check as the readers of the broker's ring
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&ring->data_head, __ATOMIC_ACQUIRE) - cursor >= capacity)
+            {
+                lost++;
+                continue;
+            }
+
+            broker.publish(sample);
+            published = true;
+        }
+
+        if (published)
+            broker.wake();
+    }
+
+    if (lost != 0)
+        std::cerr << lost << " samples were overwritten in the driver's ring before they were copied\n";
+
+    if (tail_mapping != MAP_FAILED)
+        munmap(tail_mapping, page_size);
+    munmap(mapping, size);
+    close(fd);
+
+    return ok;
+}
+
+/// @brief Publishes a slow synthetic sine wave until stopped
+bool run_simulation(const Options &options, Broker &broker, const ThermometerCalibration &calibration)
+{
+    for (__u64 i = 0; !stopping; i++)
+    {
+        timespec now;
+        ThermometerSample sample = {};
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sample.timestamp = static_cast<__u64>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+        sample.charge_time = static_cast<__u32>(1000000000.0 + 200000000.0 * std::sin(i / 100.0));
+        sample.temperature = thermometer_convert_linear(&calibration,
+                                                        thermometer_convert_resistance(&calibration, sample.charge_time));
+        sample.trigger = THERMOMETER_TRIGGER_PERIODIC;
+
+        broker.publish(sample);
+        broker.wake();
+
+        usleep(options.simulate_ms * 1000);
+    }
+
+    return true;
+}
+
+/// @brief Prints the samples of a running broker until it exits or the reader is stopped
+int run_follow(const Options &options)
+{
+    ThermometerBrokerClient client;
+    ThermometerSample samples[64];
+
+    if (thermometer_broker_open(&client, options.name.c_str()) != 0)
+    {
+        std::perror(options.name.c_str());
+        return 1;
+    }
+
+    while (!stopping)
+    {
+        int ready = thermometer_broker_wait(&client, -1);
+
+        if (ready < 0)
+        {
+            if (errno != EINTR && errno != EPIPE)
+                std::perror("wait");
+            break;
+        }
+
+        unsigned int count;
+        while ((count = thermometer_broker_read(&client, samples, 64)) != 0)
+        {
+            for (unsigned int i = 0; i < count; i++)
+            {
+                if (samples[i].flags & THERMOMETER_SAMPLE_RAW)
+                    std::printf("%llu %u\n", static_cast<unsigned long long>(samples[i].timestamp),
+                                samples[i].charge_time);
+                else
+                    std::printf("%llu %d\n", static_cast<unsigned long long>(samples[i].timestamp),
+                                samples[i].temperature);
+            }
+        }
+        std::fflush(stdout);
+    }
+
+    if (client.lost != 0)
+        std::cerr << client.lost << " samples were lost\n";
+
+    thermometer_broker_close(&client);
+
+    return 0;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (argument == "--device" && has_value)
+            options.device = argv[++i];
+        else if (argument == "--state" && has_value)
+            options.state = argv[++i];
+        else if (argument == "--name" && has_value)
+            options.name = argv[++i];
+        else if (argument == "--capacity" && has_value)
+            options.capacity = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
+        else if (argument == "--simulate" && has_value)
+            options.simulate_ms = std::atoi(argv[++i]);
+        else if (argument == "--follow")
+            options.follow = true;
+        else
+            return false;
+    }
+
+    // the shared memory name must be a single component starting with a slash
+    return options.capacity != 0 && (options.capacity & (options.capacity - 1)) == 0 && options.simulate_ms >= 0 &&
+           options.name.size() > 1 && options.name[0] == '/' && options.name.find('/', 1) == std::string::npos;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    struct sigaction action = {};
+
+    if (!parse_options(argc, argv, options))
+    {
+        std::cerr << "usage: " << argv[0] << " [--device path] [--state path] [--name name] [--capacity N]"
+                  << " [--simulate MS]\n"
+                  << "       " << argv[0] << " --follow [--name name]\n"
+                  << "--capacity is a power of 2, --name a shared memory name like " << THERMOMETER_BROKER_NAME
+                  << "\n";
+        return 1;
+    }
+
+    // no SA_RESTART, so that poll and the futex wait return to check for the stop
+    action.sa_handler = stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    if (options.follow)
+        return run_follow(options);
+
+    ThermometerCalibration calibration =
+        options.simulate_ms > 0 ? default_calibration : read_calibration(options.state);
+    Broker broker;
+
+    if (!broker.create(options, calibration))
+        return 1;
+
+    bool ok = options.simulate_ms > 0 ? run_simulation(options, broker, calibration) : run_device(options, broker);
+
+    broker.destroy(options);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+/// @file thermometer_broker.h
+/// @brief Shared memory layout of thermometer_broker and the client side for its readers
+///
+/// The broker is the only process that opens the device. It copies every sample from the driver's
+/// ring into a POSIX shared memory ring that any number of local readers map read only, so readers
+/// cost the driver nothing and read samples straight from the mapping. Readers that have caught up
+/// sleep on a futex in the shared page, which the broker wakes once per batch of samples.
+///
+/// The ring follows the driver's rules: head is the number of samples ever published, only written
+/// by the broker after each sample, and the oldest samples are overwritten. A reader copies a
+/// sample and then checks that head hasn't come within a ring of it meanwhile. A reader that falls
+/// more than a ring behind skips the lost samples and counts them in its lost field.
+
+#ifndef THERMOMETER_BROKER_H
+#define THERMOMETER_BROKER_H
+
+#include "../src/thermometer_abi.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define THERMOMETER_BROKER_MAGIC 0x4b524254U // "TBRK"
+#define THERMOMETER_BROKER_VERSION 1U
+#define THERMOMETER_BROKER_NAME "/thermometer"
+
+/// @brief The first page of the shared memory ring, the samples start at data_offset
+typedef struct ThermometerBrokerPage
+{
+    __u32 magic;
+    __u32 version;
+    __u32 sample_size;
+    __u32 capacity;          // samples in the ring, a power of 2
+    __u64 data_offset;
+    __u64 head;              // samples ever published
+    __u32 futex;             // bumped after every batch, readers wait on it
+    __u32 broker_pid;        // 0 once the broker has exited
+    ThermometerCalibration calibration;   // of the device, to convert raw samples
+} ThermometerBrokerPage;
+
+/// @brief A reader of the shared memory ring
+typedef struct ThermometerBrokerClient
+{
+    const ThermometerBrokerPage *page;
+    const ThermometerSample *samples;
+    size_t size;
+    __u64 cursor;   // the next sample to read
+    __u64 lost;     // samples overwritten before they were read
+} ThermometerBrokerClient;
+
+/// @brief The size of a shared memory ring of a given capacity
+static inline size_t thermometer_broker_size(unsigned int capacity)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    return page_size + (size_t)capacity * sizeof(ThermometerSample);
+}
+
+static inline long thermometer_broker_futex(const __u32 *word, int op, __u32 value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/// @brief Maps the shared memory ring of a running broker, reading starts at the newest sample
+/// @param[out] client the reader to set up
+/// @param[in] name the shared memory object, THERMOMETER_BROKER_NAME by default
+/// @return 0 on success, -1 with errno set otherwise
+static inline int thermometer_broker_open(ThermometerBrokerClient *client, const char *name)
+{
+    struct stat status;
+    void *mapping;
+    int fd;
+
+    memset(client, 0, sizeof(*client));
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(ThermometerBrokerPage))
+    {
+        close(fd);
+        errno = errno ? errno : EINVAL;
+        return -1;
+    }
+
+    mapping = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    client->page = (const ThermometerBrokerPage *)mapping;
+    client->size = status.st_size;
+
+    if (client->page->magic != THERMOMETER_BROKER_MAGIC || client->page->version != THERMOMETER_BROKER_VERSION ||
+        client->page->sample_size != sizeof(ThermometerSample) ||
+        client->page->data_offset + (size_t)client->page->capacity * sizeof(ThermometerSample) > client->size)
+    {
+        munmap(mapping, client->size);
+        client->page = NULL;
+        errno = EPROTO;
+        return -1;
+    }
+
+    client->samples = (const ThermometerSample *)((const char *)mapping + client->page->data_offset);
+    client->cursor = __atomic_load_n(&client->page->head, __ATOMIC_ACQUIRE);
+
+    return 0;
+}
+
+/// @brief Unmaps the shared memory ring
+static inline void thermometer_broker_close(ThermometerBrokerClient *client)
+{
+    if (client->page != NULL)
+        munmap((void *)client->page, client->size);
+
+    client->page = NULL;
+}
+
+/// @brief Copies the samples published since the last read, oldest first, without blocking
+/// @param[in] client the reader
+/// @param[out] samples where to copy the samples to
+/// @param[in] count the maximum number of samples to copy
+/// @return the number of samples copied
+static inline unsigned int thermometer_broker_read(ThermometerBrokerClient *client, ThermometerSample *samples,
+                                                   unsigned int count)
+{
+    __u64 capacity = client->page->capacity;
+    __u64 head = __atomic_load_n(&client->page->head, __ATOMIC_ACQUIRE);
+    unsigned int copied = 0;
+
+    while (copied < count && client->cursor != head)
+    {
+        if (head - client->cursor > capacity)
+        {
+            client->lost += head - capacity - client->cursor;
+            client->cursor = head - capacity;
+        }
+
+        samples[copied] = client->samples[client->cursor & (capacity - 1)];
+
+        // the broker writes the slot of sample head before publishing it, so the copy is only good
+        // if head stayed less than a ring ahead of it
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&client->page->head, __ATOMIC_ACQUIRE);
+        if (head - client->cursor >= capacity)
+        {
+            client->lost++;
+            client->cursor++;
+            continue;
+        }
+
+        client->cursor++;
+        copied++;
+    }
+
+    return copied;
+}
+
+/// @brief Waits until samples are published past the reader's cursor
+/// @param[in] client the reader
+/// @param[in] timeout_ms how long to wait, negative to wait forever
+/// @return 1 if samples are available, 0 on timeout, -1 with errno set if the broker exited or the
+/// wait failed
+static inline int thermometer_broker_wait(ThermometerBrokerClient *client, int timeout_ms)
+{
+    struct timespec timeout;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+
+    for (;;)
+    {
+        // the futex word is read before head, so a batch published in between changes it and the
+        // wait returns straight away
+        __u32 futex = __atomic_load_n(&client->page->futex, __ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&client->page->head, __ATOMIC_ACQUIRE) != client->cursor)
+            return 1;
+
+        if (__atomic_load_n(&client->page->broker_pid, __ATOMIC_ACQUIRE) == 0)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        // a relative timeout restarts on every spurious wakeup, which only lengthens the wait
+        if (thermometer_broker_futex(&client->page->futex, FUTEX_WAIT, futex, timeout_ms < 0 ? NULL : &timeout) != 0)
+        {
+            if (errno == ETIMEDOUT)
+                return 0;
+            if (errno != EAGAIN && errno != EINTR)
+                return -1;
+        }
+    }
+}
+
+#endif // THERMOMETER_BROKER_H
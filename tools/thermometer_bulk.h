@@ -0,0 +1,216 @@
+/// @file thermometer_bulk.h
+/// @brief Bulk conversion of raw charge times for user space
+///
+/// Converts arrays of charge times, as exported with the driver's raw_samples parameter, with the
+/// same linear calibration as time_to_resistance and resistance_to_temperature.  The integer
+/// divisions of thermometer_convert.h are done in double precision and truncated: every operand
+/// fits in 32 bits, so the quotients truncate to exactly what the integer code gives, and the
+/// division vectorizes where integer division doesn't.  The results match the scalar code bit for
+/// bit as long as that code doesn't overflow an int.
+///
+/// The SSE2 path is the x86-64 baseline, the AVX one is picked at run time when the CPU has it,
+/// and aarch64 always has NEON.  Anything else, e.g. the ARMv6 of the Pi Zero, falls back to the
+/// scalar code.
+
+#ifndef THERMOMETER_BULK_H
+#define THERMOMETER_BULK_H
+
+#include "../src/thermometer_convert.h"
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define THERMOMETER_BULK_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define THERMOMETER_BULK_NEON 1
+#include <arm_neon.h>
+#endif
+
+/// @brief Implementations of the bulk conversion
+enum ThermometerBulkPath
+{
+    THERMOMETER_BULK_SCALAR = 0,
+    THERMOMETER_BULK_SSE2 = 1,
+    THERMOMETER_BULK_AVX = 2,
+    THERMOMETER_BULK_NEON = 3,
+};
+
+/// @brief The scalar conversion, the reference of the vector ones and their tail
+static inline void thermometer_bulk_convert_scalar(const ThermometerCalibration *calibration,
+                                                   const __u32 *charge_times, __s32 *temperatures, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        temperatures[i] = thermometer_convert_linear(calibration,
+                                                     thermometer_convert_resistance(calibration, charge_times[i]));
+}
+
+#ifdef THERMOMETER_BULK_X86
+/// @brief Two charge times per step
+static inline void thermometer_bulk_convert_sse2(const ThermometerCalibration *calibration,
+                                                 const __u32 *charge_times, __s32 *temperatures, size_t count)
+{
+    const __m128i sign = _mm_set1_epi32((int)0x80000000U);
+    const __m128d unsign = _mm_set1_pd(2147483648.0);
+    const __m128d divisor = _mm_set1_pd(calibration->time_divisor);
+    const __m128i offset = _mm_set1_epi32(calibration->resistance_offset);
+    const __m128d ten = _mm_set1_pd(10.0);
+    const __m128d slope = _mm_set1_pd(calibration->slope);
+    const __m128d intercept = _mm_set1_pd(calibration->intercept);
+    const __m128d scale = _mm_set1_pd(calibration->scale);
+    size_t i;
+
+    for (i = 0; i + 2 <= count; i += 2)
+    {
+        // the charge times are unsigned, flipping the sign bit makes them convertible as signed
+        __m128i raw = _mm_loadl_epi64((const __m128i *)(charge_times + i));
+        __m128d time = _mm_add_pd(_mm_cvtepi32_pd(_mm_xor_si128(raw, sign)), unsign);
+        __m128i resistance = _mm_add_epi32(_mm_cvttpd_epi32(_mm_div_pd(time, divisor)), offset);
+        __m128d relative = _mm_cvtepi32_pd(_mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(resistance), ten)));
+        __m128d scaled = _mm_add_pd(_mm_mul_pd(relative, slope), intercept);
+
+        _mm_storel_epi64((__m128i *)(temperatures + i), _mm_cvttpd_epi32(_mm_div_pd(scaled, scale)));
+    }
+
+    thermometer_bulk_convert_scalar(calibration, charge_times + i, temperatures + i, count - i);
+}
+
+/// @brief Four charge times per step
+__attribute__((target("avx"))) static inline void
+thermometer_bulk_convert_avx(const ThermometerCalibration *calibration, const __u32 *charge_times,
+                             __s32 *temperatures, size_t count)
+{
+    const __m128i sign = _mm_set1_epi32((int)0x80000000U);
+    const __m256d unsign = _mm256_set1_pd(2147483648.0);
+    const __m256d divisor = _mm256_set1_pd(calibration->time_divisor);
+    const __m128i offset = _mm_set1_epi32(calibration->resistance_offset);
+    const __m256d ten = _mm256_set1_pd(10.0);
+    const __m256d slope = _mm256_set1_pd(calibration->slope);
+    const __m256d intercept = _mm256_set1_pd(calibration->intercept);
+    const __m256d scale = _mm256_set1_pd(calibration->scale);
+    size_t i;
+
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        __m128i raw = _mm_loadu_si128((const __m128i *)(charge_times + i));
+        __m256d time = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(raw, sign)), unsign);
+        __m128i resistance = _mm_add_epi32(_mm256_cvttpd_epi32(_mm256_div_pd(time, divisor)), offset);
+        __m256d relative = _mm256_cvtepi32_pd(_mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(resistance), ten)));
+        __m256d scaled = _mm256_add_pd(_mm256_mul_pd(relative, slope), intercept);
+
+        _mm_storeu_si128((__m128i *)(temperatures + i), _mm256_cvttpd_epi32(_mm256_div_pd(scaled, scale)));
+    }
+
+    thermometer_bulk_convert_scalar(calibration, charge_times + i, temperatures + i, count - i);
+}
+#endif
+
+#ifdef THERMOMETER_BULK_NEON
+/// @brief Two charge times per step
+static inline void thermometer_bulk_convert_neon(const ThermometerCalibration *calibration,
+                                                 const __u32 *charge_times, __s32 *temperatures, size_t count)
+{
+    const float64x2_t divisor = vdupq_n_f64(calibration->time_divisor);
+    const int32x2_t offset = vdup_n_s32(calibration->resistance_offset);
+    const float64x2_t ten = vdupq_n_f64(10.0);
+    const float64x2_t slope = vdupq_n_f64(calibration->slope);
+    const float64x2_t intercept = vdupq_n_f64(calibration->intercept);
+    const float64x2_t scale = vdupq_n_f64(calibration->scale);
+    size_t i;
+
+    for (i = 0; i + 2 <= count; i += 2)
+    {
+        // the conversions to integers truncate towards zero like the integer divisions
+        float64x2_t time = vcvtq_f64_u64(vmovl_u32(vld1_u32(charge_times + i)));
+        int32x2_t resistance = vadd_s32(vmovn_s64(vcvtq_s64_f64(vdivq_f64(time, divisor))), offset);
+        int32x2_t relative = vmovn_s64(vcvtq_s64_f64(vdivq_f64(vcvtq_f64_s64(vmovl_s32(resistance)), ten)));
+        float64x2_t scaled = vfmaq_f64(intercept, vcvtq_f64_s64(vmovl_s32(relative)), slope);
+
+        vst1_s32(temperatures + i, vmovn_s64(vcvtq_s64_f64(vdivq_f64(scaled, scale))));
+    }
+
+    thermometer_bulk_convert_scalar(calibration, charge_times + i, temperatures + i, count - i);
+}
+#endif
+
+/// @brief The fastest implementation the CPU runs
+static inline enum ThermometerBulkPath thermometer_bulk_best_path(void)
+{
+#if defined(THERMOMETER_BULK_X86)
+    return __builtin_cpu_supports("avx") ? THERMOMETER_BULK_AVX : THERMOMETER_BULK_SSE2;
+#elif defined(THERMOMETER_BULK_NEON)
+    return THERMOMETER_BULK_NEON;
+#else
+    return THERMOMETER_BULK_SCALAR;
+#endif
+}
+
+/// @brief Whether the CPU runs an implementation
+static inline int thermometer_bulk_path_supported(enum ThermometerBulkPath path)
+{
+    switch (path)
+    {
+    case THERMOMETER_BULK_SCALAR:
+        return 1;
+#if defined(THERMOMETER_BULK_X86)
+    case THERMOMETER_BULK_SSE2:
+        return 1;
+    case THERMOMETER_BULK_AVX:
+        return __builtin_cpu_supports("avx");
+#elif defined(THERMOMETER_BULK_NEON)
+    case THERMOMETER_BULK_NEON:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/// @brief Converts charge times into temperatures with a given implementation
+/// @note an implementation the CPU doesn't run falls back to the scalar one
+/// @param[in] path the implementation to use
+/// @param[in] calibration the calibration the charge times were taken with, time_divisor and
+/// scale must not be 0
+/// @param[in] charge_times the charge times in ns
+/// @param[out] temperatures the temperatures in degrees C, may not overlap charge_times
+/// @param[in] count the number of charge times
+static inline void thermometer_bulk_convert_with(enum ThermometerBulkPath path, const ThermometerCalibration *calibration,
+                                                 const __u32 *charge_times, __s32 *temperatures, size_t count)
+{
+    if (!thermometer_bulk_path_supported(path))
+        path = THERMOMETER_BULK_SCALAR;
+
+    switch (path)
+    {
+#if defined(THERMOMETER_BULK_X86)
+    case THERMOMETER_BULK_SSE2:
+        thermometer_bulk_convert_sse2(calibration, charge_times, temperatures, count);
+        break;
+    case THERMOMETER_BULK_AVX:
+        thermometer_bulk_convert_avx(calibration, charge_times, temperatures, count);
+        break;
+#elif defined(THERMOMETER_BULK_NEON)
+    case THERMOMETER_BULK_NEON:
+        thermometer_bulk_convert_neon(calibration, charge_times, temperatures, count);
+        break;
+#endif
+    default:
+        thermometer_bulk_convert_scalar(calibration, charge_times, temperatures, count);
+        break;
+    }
+}
+
+/// @brief Converts charge times into temperatures with the fastest implementation
+/// @param[in] calibration the calibration the charge times were taken with
+/// @param[in] charge_times the charge times in ns
+/// @param[out] temperatures the temperatures in degrees C
+/// @param[in] count the number of charge times
+static inline void thermometer_bulk_convert(const ThermometerCalibration *calibration, const __u32 *charge_times,
+                                            __s32 *temperatures, size_t count)
+{
+    thermometer_bulk_convert_with(thermometer_bulk_best_path(), calibration, charge_times, temperatures, count);
+}
+
+#endif // THERMOMETER_BULK_H
@@ -0,0 +1,410 @@
+/// @file thermometer_calibrate.cpp
+/// @brief Host tool that fits the driver's calibration to charge times logged against a reference
+///
+/// The input holds one "charge_time_ns,reference_temperature_c[,resistance_ohm]" record per line,
+/// lines that don't start with a number are skipped.  The time to resistance model is fitted with
+/// least squares against the reference resistance of every record, which is taken from the third
+/// column when present, from the thermistor's R-T table when --rt-csv is given, or from inverting
+/// the current linear conversion otherwise.  When every record has a measured resistance the
+/// linear resistance to temperature model is fitted as well.
+///
+/// usage: thermometer_calibrate [--rt-csv table.csv] [--scale N] [--blob out.bin]
+///                              [--header out.h] [--verbose] records.csv
+
+#include "../src/thermometer_abi.h"
+#include "../src/thermometer_convert.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+/// @brief The constants of the driver's default calibration
+const ThermometerCalibration default_calibration = {50000, 8000, -18, 55685, 463, 0};
+
+struct Record
+{
+    double charge_time;
+    double temperature;
+    double resistance;
+    bool has_resistance;
+};
+
+struct RtPoint
+{
+    double temperature;
+    double resistance;
+};
+
+struct LinearFit
+{
+    double slope;
+    double intercept;
+};
+
+struct Options
+{
+    std::string records_path;
+    std::string rt_csv_path;
+    std::string blob_path;
+    std::string header_path;
+    int scale = 10000;
+    bool verbose = false;
+};
+
+bool starts_with_number(const std::string &line)
+{
+    auto first = line.find_first_not_of(" \t");
+
+    return first != std::string::npos &&
+           (std::isdigit(static_cast<unsigned char>(line[first])) || line[first] == '-' || line[first] == '+');
+}
+
+/// @brief Splits a CSV line into numbers
+std::vector<double> parse_fields(const std::string &line)
+{
+    std::vector<double> fields;
+    std::stringstream stream(line);
+    std::string field;
+
+    while (std::getline(stream, field, ','))
+        fields.push_back(std::stod(field));
+
+    return fields;
+}
+
+bool read_records(const std::string &path, std::vector<Record> &records)
+{
+    std::ifstream file(path);
+    std::string line;
+
+    if (!file)
+    {
+        std::cerr << "Can't open " << path << "\n";
+        return false;
+    }
+
+    while (std::getline(file, line))
+    {
+        if (!starts_with_number(line))
+            continue;
+
+        std::vector<double> fields;
+        try
+        {
+            fields = parse_fields(line);
+        }
+        catch (const std::exception &)
+        {
+            fields.clear();
+        }
+
+        if (fields.size() < 2 || fields.size() > 3 || fields[0] <= 0.0)
+        {
+            std::cerr << path << ": malformed line: " << line << "\n";
+            return false;
+        }
+
+        records.push_back({fields[0], fields[1], fields.size() == 3 ? fields[2] : 0.0, fields.size() == 3});
+    }
+
+    return true;
+}
+
+bool read_rt_table(const std::string &path, std::vector<RtPoint> &points)
+{
+    std::ifstream file(path);
+    std::string line;
+
+    if (!file)
+    {
+        std::cerr << "Can't open " << path << "\n";
+        return false;
+    }
+
+    while (std::getline(file, line))
+    {
+        if (!starts_with_number(line))
+            continue;
+
+        std::vector<double> fields;
+        try
+        {
+            fields = parse_fields(line);
+        }
+        catch (const std::exception &)
+        {
+            fields.clear();
+        }
+
+        if (fields.size() != 2 || fields[1] <= 0.0)
+        {
+            std::cerr << path << ": malformed line: " << line << "\n";
+            return false;
+        }
+
+        points.push_back({fields[0], fields[1]});
+    }
+
+    std::sort(points.begin(), points.end(),
+              [](const RtPoint &a, const RtPoint &b) { return a.temperature < b.temperature; });
+
+    if (points.size() < 2)
+    {
+        std::cerr << path << " needs at least 2 points\n";
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief Interpolates the R-T table in ln(R), the same way thermometer_lut_gen resamples it
+double table_resistance(const std::vector<RtPoint> &points, double temperature)
+{
+    size_t i = 1;
+
+    while (i < points.size() - 1 && points[i].temperature < temperature)
+        i++;
+
+    double fraction = (temperature - points[i - 1].temperature) /
+                      (points[i].temperature - points[i - 1].temperature);
+
+    return std::exp(std::log(points[i - 1].resistance) +
+                    fraction * (std::log(points[i].resistance) - std::log(points[i - 1].resistance)));
+}
+
+double table_temperature(const std::vector<RtPoint> &points, double resistance)
+{
+    // the table is sorted by temperature, so resistance descends
+    size_t i = 1;
+
+    while (i < points.size() - 1 && points[i].resistance > resistance)
+        i++;
+
+    double fraction = (std::log(resistance) - std::log(points[i - 1].resistance)) /
+                      (std::log(points[i].resistance) - std::log(points[i - 1].resistance));
+
+    return points[i - 1].temperature + fraction * (points[i].temperature - points[i - 1].temperature);
+}
+
+/// @brief Ordinary least squares fit of y = slope * x + intercept
+bool fit_line(const std::vector<double> &x, const std::vector<double> &y, LinearFit &fit)
+{
+    double n = static_cast<double>(x.size());
+    double mean_x = 0.0, mean_y = 0.0, sxx = 0.0, sxy = 0.0;
+
+    for (size_t i = 0; i < x.size(); i++)
+    {
+        mean_x += x[i];
+        mean_y += y[i];
+    }
+    mean_x /= n;
+    mean_y /= n;
+
+    for (size_t i = 0; i < x.size(); i++)
+    {
+        sxx += (x[i] - mean_x) * (x[i] - mean_x);
+        sxy += (x[i] - mean_x) * (y[i] - mean_y);
+    }
+
+    if (sxx == 0.0)
+        return false;
+
+    fit.slope = sxy / sxx;
+    fit.intercept = mean_y - fit.slope * mean_x;
+
+    return true;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (argument == "--rt-csv" && has_value)
+            options.rt_csv_path = argv[++i];
+        else if (argument == "--blob" && has_value)
+            options.blob_path = argv[++i];
+        else if (argument == "--header" && has_value)
+            options.header_path = argv[++i];
+        else if (argument == "--scale" && has_value)
+            options.scale = std::atoi(argv[++i]);
+        else if (argument == "--verbose")
+            options.verbose = true;
+        else if (argument[0] != '-' && options.records_path.empty())
+            options.records_path = argument;
+        else
+            return false;
+    }
+
+    return !options.records_path.empty() && options.scale > 0;
+}
+
+bool write_blob(const std::string &path, const ThermometerCalibration &calibration)
+{
+    // a state blob without samples, importing it only replaces the calibration
+    ThermometerStateHeader header = {};
+    header.magic = THERMOMETER_STATE_MAGIC;
+    header.version = THERMOMETER_STATE_VERSION;
+    header.size = sizeof(header);
+    header.sample_count = 0;
+    header.calibration = calibration;
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    return static_cast<bool>(file);
+}
+
+bool write_header(const std::string &path, const std::string &source, const ThermometerCalibration &calibration)
+{
+    std::ofstream file(path);
+
+    file << "// Generated by tools/thermometer_calibrate from " << source << ", do not edit\n\n"
+         << "#ifndef THERMOMETER_PROFILE_H\n#define THERMOMETER_PROFILE_H\n\n"
+         << "#define THERMOMETER_PROFILE_CALIBRATION \\\n"
+         << "    { \\\n"
+         << "        .time_divisor = " << calibration.time_divisor << ", \\\n"
+         << "        .resistance_offset = " << calibration.resistance_offset << ", \\\n"
+         << "        .slope = " << calibration.slope << ", \\\n"
+         << "        .intercept = " << calibration.intercept << ", \\\n"
+         << "        .scale = " << calibration.scale << ", \\\n"
+         << "    }\n\n"
+         << "#endif // THERMOMETER_PROFILE_H\n";
+
+    return static_cast<bool>(file);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    std::vector<Record> records;
+    std::vector<RtPoint> table;
+    ThermometerCalibration calibration = default_calibration;
+
+    if (!parse_options(argc, argv, options))
+    {
+        std::cerr << "usage: " << argv[0]
+                  << " [--rt-csv table.csv] [--scale N] [--blob out.bin] [--header out.h] [--verbose] records.csv\n";
+        return 1;
+    }
+
+    if (!read_records(options.records_path, records))
+        return 1;
+
+    if (!options.rt_csv_path.empty() && !read_rt_table(options.rt_csv_path, table))
+        return 1;
+
+    if (records.size() < 2)
+    {
+        std::cerr << options.records_path << " needs at least 2 records\n";
+        return 1;
+    }
+
+    bool measured_resistance = std::all_of(records.begin(), records.end(),
+                                           [](const Record &record) { return record.has_resistance; });
+
+    std::vector<double> charge_times, resistances, temperatures;
+    for (Record &record : records)
+    {
+        if (!measured_resistance)
+        {
+            if (!table.empty())
+                record.resistance = table_resistance(table, record.temperature);
+            else
+                record.resistance = (record.temperature * default_calibration.scale - default_calibration.intercept) /
+                                    default_calibration.slope * 10.0;
+        }
+
+        charge_times.push_back(record.charge_time);
+        resistances.push_back(record.resistance);
+        temperatures.push_back(record.temperature);
+    }
+
+    LinearFit time_fit;
+    if (!fit_line(charge_times, resistances, time_fit) || time_fit.slope <= 0.0)
+    {
+        std::cerr << "Can't fit the time to resistance model, are the charge times all the same?\n";
+        return 1;
+    }
+
+    // the driver divides the charge time by the divisor, a slope above 2 ohm/ns rounds it to 0
+    double time_divisor = std::round(1.0 / time_fit.slope);
+    if (!(time_divisor > 0.0 && time_divisor <= UINT32_MAX))
+    {
+        std::cerr << "The fitted time to resistance slope " << time_fit.slope
+                  << " ohm/ns gives no usable time_divisor, check the records\n";
+        return 1;
+    }
+
+    calibration.time_divisor = static_cast<uint32_t>(time_divisor);
+    calibration.resistance_offset = static_cast<int32_t>(std::lround(time_fit.intercept));
+
+    if (measured_resistance && table.empty())
+    {
+        // the driver computes ((R / 10) * slope + intercept) / scale
+        LinearFit conversion_fit;
+        if (!fit_line(resistances, temperatures, conversion_fit))
+        {
+            std::cerr << "Can't fit the resistance to temperature model, are the resistances all the same?\n";
+            return 1;
+        }
+
+        calibration.scale = options.scale;
+        calibration.slope = static_cast<int32_t>(std::lround(conversion_fit.slope * 10.0 * options.scale));
+        calibration.intercept = static_cast<int32_t>(std::lround(conversion_fit.intercept * options.scale));
+    }
+
+    double sum_squares = 0.0, worst = 0.0;
+    for (const Record &record : records)
+    {
+        int32_t resistance = thermometer_convert_resistance(&calibration, static_cast<uint64_t>(record.charge_time));
+        double predicted = table.empty() ? thermometer_convert_linear(&calibration, resistance)
+                                         : table_temperature(table, resistance);
+        double residual = predicted - record.temperature;
+
+        sum_squares += residual * residual;
+        worst = std::max(worst, std::fabs(residual));
+
+        if (options.verbose)
+            std::printf("%12.0f ns %8.2f C -> %8d ohm %8.2f C (%+.2f)\n", record.charge_time,
+                        record.temperature, resistance, predicted, residual);
+    }
+
+    std::printf("records:           %zu\n", records.size());
+    std::printf("time_divisor:      %u\n", calibration.time_divisor);
+    std::printf("resistance_offset: %d\n", calibration.resistance_offset);
+    std::printf("slope:             %d\n", calibration.slope);
+    std::printf("intercept:         %d\n", calibration.intercept);
+    std::printf("scale:             %d\n", calibration.scale);
+    std::printf("conversion:        %s\n", table.empty() ? "linear" : "R-T table");
+    std::printf("rms residual:      %.3f C\n", std::sqrt(sum_squares / records.size()));
+    std::printf("max residual:      %.3f C\n", worst);
+
+    if (!options.blob_path.empty() && !write_blob(options.blob_path, calibration))
+    {
+        std::cerr << "Can't write " << options.blob_path << "\n";
+        return 1;
+    }
+
+    if (!options.header_path.empty() && !write_header(options.header_path, options.records_path, calibration))
+    {
+        std::cerr << "Can't write " << options.header_path << "\n";
+        return 1;
+    }
+
+    return 0;
+}
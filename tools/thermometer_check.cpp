@@ -0,0 +1,436 @@
+/// @file thermometer_check.cpp
+/// @brief Round trip checks of the host tools, run by make check
+///
+/// Each check exercises a tool or header against a reference it must reproduce:
+///   columns   samples recorded by thermometer_recorder decode back to the same values, and the
+///             aggregate of a range matches summing the samples one by one
+///   rebuild   a recording stripped of its index and ending in a partial block reads the same
+///   lut       the table thermometer_lut_gen makes of the linear conversion reproduces
+///             thermometer_convert_linear
+///   fit       thermometer_calibrate recovers the constants a synthetic CSV was generated with
+///   bulk      every thermometer_bulk.h implementation the CPU runs matches the scalar code
+///   broker    readers of the broker's ring never return a torn sample while it is overwritten
+///
+/// The recorder and the calibrator are run from the current directory, scratch files go to a
+/// temporary directory that is removed afterwards.
+///
+/// usage: thermometer_check [check...]
+
+#include "../src/thermometer_abi.h"
+#include "../src/thermometer_convert.h"
+#include "thermometer_broker.h"
+#include "thermometer_bulk.h"
+#include "thermometer_check_lut.h"
+#include "thermometer_columns.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+/// @brief The driver's default calibration, the Makefile generates thermometer_check_linear.csv
+/// from its slope, intercept and scale
+const ThermometerCalibration default_calibration = {50000, 8000, -18, 55685, 463, 0};
+
+std::string scratch;
+
+bool fail(const std::string &message)
+{
+    std::cerr << "  " << message << "\n";
+    return false;
+}
+
+bool run(const std::string &command)
+{
+    return std::system(command.c_str()) == 0 || fail("failed: " + command);
+}
+
+/// @brief Records lines of "timestamp value" with small blocks
+bool record(const std::string &path, const std::vector<uint64_t> &timestamps, const std::vector<int32_t> &values)
+{
+    std::string input = scratch + "/samples.txt";
+    std::ofstream file(input);
+
+    for (size_t i = 0; i < timestamps.size(); i++)
+        file << timestamps[i] << " " << values[i] << "\n";
+    file.close();
+
+    std::remove(path.c_str());
+
+    return run("./thermometer_recorder record " + path + " --input " + input +
+               " --block-samples 7 --flush-s 0 2>/dev/null");
+}
+
+/// @brief Decodes every block of a recording and compares it with the samples it was made from
+bool compare(const ThermometerColumnsReader &reader, const std::vector<uint64_t> &timestamps,
+             const std::vector<int32_t> &values)
+{
+    std::vector<__u64> decoded_timestamps(reader.header->block_samples);
+    std::vector<__s32> decoded_values(reader.header->block_samples);
+    size_t next = 0;
+
+    for (uint32_t block = 0; block < reader.block_count; block++)
+    {
+        int count = thermometer_columns_decode(&reader, block, decoded_timestamps.data(), decoded_values.data());
+        if (count < 0)
+            return fail("block " + std::to_string(block) + " doesn't decode");
+
+        for (int i = 0; i < count; i++, next++)
+        {
+            if (next >= timestamps.size() || decoded_timestamps[i] != timestamps[next] ||
+                decoded_values[i] != values[next])
+                return fail("sample " + std::to_string(next) + " differs");
+        }
+    }
+
+    return next == timestamps.size() || fail(std::to_string(next) + " of " + std::to_string(timestamps.size()) +
+                                              " samples decoded");
+}
+
+/// @brief Samples with gaps from 0 to beyond 32 bits and values swinging across the whole int range
+void make_samples(std::vector<uint64_t> &timestamps, std::vector<int32_t> &values)
+{
+    std::mt19937_64 random(1);
+    const uint64_t gaps[] = {0, 1, 127, 128, 1000000000ULL, 1ULL << 40};
+    const int32_t extremes[] = {INT32_MIN, INT32_MAX, 0, -1, 1};
+    uint64_t timestamp = 1ULL << 50;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        timestamp += gaps[random() % 6] + random() % 3;
+        timestamps.push_back(timestamp);
+        values.push_back(i % 9 == 0 ? extremes[random() % 5] : static_cast<int32_t>(random()));
+    }
+}
+
+bool check_columns()
+{
+    std::vector<uint64_t> timestamps;
+    std::vector<int32_t> values;
+    std::string path = scratch + "/columns.tcol";
+    ThermometerColumnsReader reader;
+
+    make_samples(timestamps, values);
+    if (!record(path, timestamps, values))
+        return false;
+
+    if (thermometer_columns_open(&reader, path.c_str()) != 0)
+        return fail("can't open the recording");
+
+    bool ok = reader.closed || fail("the recording has no index");
+    ok = ok && compare(reader, timestamps, values);
+
+    // a range that starts and ends inside blocks, so both the headers and the decoding are used
+    std::vector<__u64> scratch_timestamps(reader.header->block_samples);
+    std::vector<__s32> scratch_values(reader.header->block_samples);
+    ThermometerColumnsAggregate aggregate;
+    uint64_t from = timestamps[100] + 1;
+    uint64_t to = timestamps[900];
+    uint64_t count = 0;
+    int64_t sum = 0;
+    int32_t low = INT32_MAX;
+    int32_t high = INT32_MIN;
+
+    for (size_t i = 0; i < timestamps.size(); i++)
+    {
+        if (timestamps[i] >= from && timestamps[i] < to)
+        {
+            count++;
+            sum += values[i];
+            low = std::min(low, values[i]);
+            high = std::max(high, values[i]);
+        }
+    }
+
+    if (ok && thermometer_columns_aggregate(&reader, from, to, &aggregate, scratch_timestamps.data(),
+                                            scratch_values.data()) != 0)
+        ok = fail("the aggregate hit a corrupt block");
+    else if (ok && (aggregate.count != count || aggregate.sum != sum || aggregate.min != low || aggregate.max != high))
+        ok = fail("the aggregate differs from the samples");
+
+    thermometer_columns_close(&reader);
+
+    return ok;
+}
+
+bool check_rebuild()
+{
+    std::vector<uint64_t> timestamps;
+    std::vector<int32_t> values;
+    std::string path = scratch + "/rebuild.tcol";
+    ThermometerColumnsReader reader;
+    uint64_t index_offset;
+
+    make_samples(timestamps, values);
+    if (!record(path, timestamps, values))
+        return false;
+
+    if (thermometer_columns_open(&reader, path.c_str()) != 0)
+        return fail("can't open the recording");
+    index_offset = reader.index[reader.block_count - 1].offset + reader.index[reader.block_count - 1].block.size;
+    ThermometerColumnsBlock partial = reader.index[0].block;
+    thermometer_columns_close(&reader);
+
+    // as if the recorder died halfway through writing a block, before it wrote the index
+    if (truncate(path.c_str(), static_cast<off_t>(index_offset)) != 0)
+        return fail("can't truncate the recording");
+    std::ofstream file(path, std::ios::binary | std::ios::app);
+    file.write(reinterpret_cast<const char *>(&partial), sizeof(partial) / 2);
+    file.close();
+
+    if (thermometer_columns_open(&reader, path.c_str()) != 0)
+        return fail("can't open the unclosed recording");
+
+    bool ok = !reader.closed || fail("the unclosed recording reads as closed");
+    ok = ok && compare(reader, timestamps, values);
+    thermometer_columns_close(&reader);
+
+    return ok;
+}
+
+bool check_lut()
+{
+    const ThermometerCalibration &calibration = default_calibration;
+
+    // the range of thermometer_check_linear.csv, -20 to 80 C
+    for (int resistance = 10400; resistance <= 36000; resistance += 3)
+    {
+        int table = thermometer_convert_lut(thermometer_lut, THERMOMETER_LUT_ENTRIES, resistance);
+        int linear = thermometer_convert_linear(&calibration, resistance);
+        // the driver divides by 10 first, so its result steps every 10 ohms
+        double exact = ((resistance / 10) * calibration.slope + calibration.intercept) * 1000.0 / calibration.scale;
+        double step = std::abs(calibration.slope) * 1000.0 / calibration.scale;
+
+        if (std::abs(table - exact) > step + 5.0)
+            return fail("the table gives " + std::to_string(table) + " mC at " + std::to_string(resistance) +
+                        " ohm, the linear conversion " + std::to_string(exact));
+
+        // the driver truncates to whole degrees
+        if (std::abs(table - linear * 1000) >= 1000 + step + 5.0)
+            return fail("thermometer_convert_linear gives " + std::to_string(linear) + " C at " +
+                        std::to_string(resistance) + " ohm, the table " + std::to_string(table) + " mC");
+    }
+
+    return true;
+}
+
+bool check_fit()
+{
+    // the constants the records are generated from, resistance = charge_time / 40000 + 5000 and
+    // temperature = ((resistance / 10) * -40 + 600000) / 10000
+    const ThermometerCalibration expected = {40000, 5000, -40, 600000, 10000, 0};
+    std::string records = scratch + "/records.csv";
+    std::string blob = scratch + "/fit.bin";
+    std::ofstream file(records);
+
+    file << "charge_time_ns,reference_c,resistance_ohm\n";
+    for (int i = 0; i < 50; i++)
+    {
+        double charge_time = 200000000.0 + i * 10000000.0;
+        double resistance = charge_time / expected.time_divisor + expected.resistance_offset;
+        double temperature = (resistance / 10.0 * expected.slope + expected.intercept) / expected.scale;
+
+        file.precision(12);
+        file << charge_time << "," << temperature << "," << resistance << "\n";
+    }
+    file.close();
+
+    if (!run("./thermometer_calibrate --scale 10000 --blob " + blob + " " + records + " >/dev/null"))
+        return false;
+
+    ThermometerStateHeader header = {};
+    std::ifstream input(blob, std::ios::binary);
+    if (!input.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != THERMOMETER_STATE_MAGIC)
+        return fail("can't read the fitted blob");
+
+    const ThermometerCalibration &fitted = header.calibration;
+    if (fitted.time_divisor != expected.time_divisor || fitted.resistance_offset != expected.resistance_offset ||
+        fitted.slope != expected.slope || fitted.intercept != expected.intercept || fitted.scale != expected.scale)
+        return fail("fitted " + std::to_string(fitted.time_divisor) + " " + std::to_string(fitted.resistance_offset) +
+                    " " + std::to_string(fitted.slope) + " " + std::to_string(fitted.intercept) + " " +
+                    std::to_string(fitted.scale));
+
+    return true;
+}
+
+bool check_bulk()
+{
+    const enum ThermometerBulkPath paths[] = {THERMOMETER_BULK_SSE2, THERMOMETER_BULK_AVX, THERMOMETER_BULK_NEON};
+    const char *const names[] = {"sse2", "avx", "neon"};
+    std::mt19937 random(1);
+    std::vector<__u32> charge_times;
+
+    // charge times of up to a second, the ends included
+    for (int i = 0; i < 4099; i++)
+        charge_times.push_back(random() % 1000000000U);
+    charge_times.push_back(0);
+    charge_times.push_back(999999999U);
+
+    std::vector<__s32> expected(charge_times.size());
+    std::vector<__s32> converted(charge_times.size());
+    thermometer_bulk_convert_scalar(&default_calibration, charge_times.data(), expected.data(), charge_times.size());
+
+    for (size_t path = 0; path < 3; path++)
+    {
+        if (!thermometer_bulk_path_supported(paths[path]))
+            continue;
+
+        // an odd count so that the scalar tail runs too
+        std::fill(converted.begin(), converted.end(), 0);
+        thermometer_bulk_convert_with(paths[path], &default_calibration, charge_times.data(), converted.data(),
+                                      charge_times.size());
+        for (size_t i = 0; i < charge_times.size(); i++)
+        {
+            if (converted[i] != expected[i])
+                return fail(std::string(names[path]) + " converts " + std::to_string(charge_times[i]) + " to " +
+                            std::to_string(converted[i]) + ", scalar to " + std::to_string(expected[i]));
+        }
+    }
+
+    return true;
+}
+
+bool check_broker()
+{
+    const unsigned int capacity = 2;
+    const __u64 published = 2000000;
+    std::string name = "/thermometer_check_" + std::to_string(getpid());
+    size_t size = thermometer_broker_size(capacity);
+    ThermometerBrokerClient client;
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+        return fail("can't create the shared memory ring");
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        return fail("can't map the shared memory ring");
+    }
+
+    auto *page = static_cast<ThermometerBrokerPage *>(mapping);
+    auto *samples = reinterpret_cast<ThermometerSample *>(static_cast<char *>(mapping) + sysconf(_SC_PAGESIZE));
+    page->version = THERMOMETER_BROKER_VERSION;
+    page->sample_size = sizeof(ThermometerSample);
+    page->capacity = capacity;
+    page->data_offset = static_cast<__u64>(sysconf(_SC_PAGESIZE));
+    page->broker_pid = static_cast<__u32>(getpid());
+    __atomic_store_n(&page->magic, THERMOMETER_BROKER_MAGIC, __ATOMIC_RELEASE);
+
+    bool ok = thermometer_broker_open(&client, name.c_str()) == 0 || fail("can't open the ring as a reader");
+    std::atomic<bool> done(false);
+
+    // publishes like thermometer_broker's Broker::publish, every field of sample i holds i. The
+    // fields are stored one by one, which widens the window a torn copy could fall into
+    std::thread writer([&]() {
+        for (__u64 i = 0; i < published; i++)
+        {
+            __u64 head = page->head;
+            volatile ThermometerSample *slot = &samples[head & (capacity - 1)];
+
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            slot->timestamp = i;
+            slot->charge_time = static_cast<__u32>(i);
+            slot->temperature = static_cast<__s32>(i);
+            slot->trigger_latency = static_cast<__u32>(i);
+            slot->reserved = ~i;
+            __atomic_store_n(&page->head, head + 1, __ATOMIC_RELEASE);
+        }
+        done = true;
+    });
+
+    __u64 read = 0;
+    __u64 last = 0;
+    bool first = true;
+    while (ok)
+    {
+        ThermometerSample batch[16];
+        bool finished = done;
+        unsigned int count = thermometer_broker_read(&client, batch, 16);
+
+        for (unsigned int i = 0; i < count && ok; i++)
+        {
+            const ThermometerSample &sample = batch[i];
+
+            if (sample.charge_time != static_cast<__u32>(sample.timestamp) ||
+                sample.temperature != static_cast<__s32>(sample.timestamp) ||
+                sample.trigger_latency != static_cast<__u32>(sample.timestamp) || sample.reserved != ~sample.timestamp)
+                ok = fail("torn sample " + std::to_string(sample.timestamp));
+            else if (!first && sample.timestamp <= last)
+                ok = fail("sample " + std::to_string(sample.timestamp) + " after " + std::to_string(last));
+            last = sample.timestamp;
+            first = false;
+        }
+        read += count;
+
+        if (finished && count == 0)
+            break;
+    }
+    writer.join();
+
+    // every sample the reader moved past was either returned or counted as lost
+    if (ok && read + client.lost != client.cursor)
+        ok = fail("the reader lost count of the samples");
+    if (ok && client.cursor != published)
+        ok = fail("the reader stopped at " + std::to_string(client.cursor) + " of " + std::to_string(published));
+
+    thermometer_broker_close(&client);
+    munmap(mapping, size);
+    shm_unlink(name.c_str());
+
+    return ok;
+}
+
+struct Check
+{
+    const char *name;
+    bool (*run)();
+};
+
+const Check checks[] = {
+    {"columns", check_columns}, {"rebuild", check_rebuild}, {"lut", check_lut},
+    {"fit", check_fit},         {"bulk", check_bulk},       {"broker", check_broker},
+};
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    char directory[] = "/tmp/thermometer_check.XXXXXX";
+    int failed = 0;
+
+    if (mkdtemp(directory) == nullptr)
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    scratch = directory;
+
+    for (const Check &check : checks)
+    {
+        if (argc > 1 && std::find_if(argv + 1, argv + argc, [&check](const char *name) {
+                            return std::string(name) == check.name;
+                        }) == argv + argc)
+            continue;
+
+        bool ok = check.run();
+        std::cout << (ok ? "ok      " : "FAILED  ") << check.name << std::endl;
+        failed += ok ? 0 : 1;
+    }
+
+    run("rm -rf " + scratch);
+
+    return failed == 0 ? 0 : 1;
+}
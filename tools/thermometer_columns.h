@@ -0,0 +1,392 @@
+/// @file thermometer_columns.h
+/// @brief Columnar file format of thermometer_recorder and the reader side of it
+///
+/// A recording is a file header followed by blocks of up to block_samples samples. Each block
+/// starts with a header that holds the first timestamp and value, the last timestamp and the
+/// minimum, maximum and sum of the values. The timestamps follow as LEB128 deltas and the values as
+/// zigzag LEB128 deltas, in separate columns. A closed recording ends with an index of every block
+/// header and a footer pointing at it, so a reader maps the file, binary searches the index for a
+/// time range and only decodes the blocks at its ends. Blocks wholly inside the range are
+/// aggregated from their headers alone. A recording whose recorder didn't close it has no footer,
+/// its index is rebuilt by walking the block headers.
+///
+/// The header's flags say what the columns hold. Timestamps are CLOCK_MONOTONIC unless
+/// THERMOMETER_COLUMNS_REALTIME is set, and values are temperatures unless THERMOMETER_COLUMNS_RAW
+/// marks them as charge times in ns. A recording holds one kind only.
+
+#ifndef THERMOMETER_COLUMNS_H
+#define THERMOMETER_COLUMNS_H
+
+#include <linux/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define THERMOMETER_COLUMNS_MAGIC 0x4c4f4354U        // "TCOL"
+#define THERMOMETER_COLUMNS_BLOCK_MAGIC 0x4b4c4254U  // "TBLK"
+#define THERMOMETER_COLUMNS_INDEX_MAGIC 0x58444954U  // "TIDX"
+#define THERMOMETER_COLUMNS_VERSION 1U
+#define THERMOMETER_COLUMNS_BLOCK_SAMPLES 4096U
+#define THERMOMETER_COLUMNS_ALIGN 8U                  // blocks and the index start on 8 byte boundaries
+
+#define THERMOMETER_COLUMNS_REALTIME 0x1U   // timestamps are CLOCK_REALTIME, so they keep rising across reboots
+#define THERMOMETER_COLUMNS_RAW 0x2U        // values are charge times in ns rather than temperatures
+
+/// @brief The start of a recording
+typedef struct ThermometerColumnsHeader
+{
+    __u32 magic;
+    __u32 version;
+    __u32 header_size;     // offset of the first block
+    __u32 block_samples;   // most samples a block holds
+    __u64 created;         // CLOCK_REALTIME of the recording's start, in ns
+    __u32 flags;           // THERMOMETER_COLUMNS_*
+    __u32 reserved;
+} ThermometerColumnsHeader;
+
+/// @brief The header of a block, followed by timestamp_bytes of timestamps and then the values
+typedef struct ThermometerColumnsBlock
+{
+    __u32 magic;
+    __u32 count;             // samples in the block, at least 1
+    __u32 size;              // of the whole block including this header and its padding
+    __u32 timestamp_bytes;
+    __u64 first_timestamp;   // ns
+    __u64 last_timestamp;
+    __s32 first_value;
+    __s32 min;
+    __s32 max;
+    __u32 reserved;
+    __s64 sum;
+} ThermometerColumnsBlock;
+
+/// @brief One entry of the index at the end of a closed recording
+typedef struct ThermometerColumnsIndex
+{
+    __u64 offset;   // of the block from the start of the file
+    ThermometerColumnsBlock block;
+} ThermometerColumnsIndex;
+
+/// @brief The last bytes of a closed recording
+typedef struct ThermometerColumnsFooter
+{
+    __u64 index_offset;
+    __u32 block_count;
+    __u32 magic;
+} ThermometerColumnsFooter;
+
+/// @brief Summary of the samples in a time range
+typedef struct ThermometerColumnsAggregate
+{
+    __u64 count;
+    __s32 min;
+    __s32 max;
+    __s64 sum;
+    __u32 blocks_decoded;   // blocks at the ends of the range that had to be decoded
+} ThermometerColumnsAggregate;
+
+/// @brief A recording mapped for reading
+typedef struct ThermometerColumnsReader
+{
+    const unsigned char *data;
+    size_t size;
+    const ThermometerColumnsHeader *header;
+    const ThermometerColumnsIndex *index;
+    ThermometerColumnsIndex *rebuilt_index;   // owned, when the recording had no footer
+    __u32 block_count;
+    int closed;                               // the recording had a footer
+} ThermometerColumnsReader;
+
+static inline size_t thermometer_columns_align(size_t size)
+{
+    return (size + THERMOMETER_COLUMNS_ALIGN - 1) & ~(size_t)(THERMOMETER_COLUMNS_ALIGN - 1);
+}
+
+/// @brief Appends an unsigned LEB128 value
+/// @return the number of bytes written, at most 10
+static inline unsigned int thermometer_columns_put(unsigned char *out, __u64 value)
+{
+    unsigned int length = 0;
+
+    while (value >= 0x80)
+    {
+        out[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char)value;
+
+    return length;
+}
+
+/// @brief Reads an unsigned LEB128 value
+/// @return the position after the value, NULL if it runs past end
+static inline const unsigned char *thermometer_columns_get(const unsigned char *in, const unsigned char *end,
+                                                           __u64 *value)
+{
+    unsigned int shift = 0;
+
+    *value = 0;
+    while (in < end && shift < 64)
+    {
+        unsigned char byte = *in++;
+
+        *value |= (__u64)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return in;
+        shift += 7;
+    }
+
+    return NULL;
+}
+
+static inline __u64 thermometer_columns_zigzag(__s64 value)
+{
+    return ((__u64)value << 1) ^ (__u64)(value >> 63);
+}
+
+static inline __s64 thermometer_columns_unzigzag(__u64 value)
+{
+    return (__s64)(value >> 1) ^ -(__s64)(value & 1);
+}
+
+/// @brief Checks a block header against the bounds of the mapping
+static inline int thermometer_columns_block_valid(const ThermometerColumnsReader *reader, __u64 offset,
+                                                  const ThermometerColumnsBlock *block)
+{
+    return block->magic == THERMOMETER_COLUMNS_BLOCK_MAGIC && block->count != 0 &&
+           block->count <= reader->header->block_samples && block->size >= sizeof(*block) &&
+           offset + block->size <= reader->size && block->timestamp_bytes <= block->size - sizeof(*block);
+}
+
+/// @brief Walks the blocks of a recording that wasn't closed
+static inline int thermometer_columns_rebuild_index(ThermometerColumnsReader *reader)
+{
+    __u64 offset = reader->header->header_size;
+    __u32 capacity = 0;
+
+    while (offset + sizeof(ThermometerColumnsBlock) <= reader->size)
+    {
+        const ThermometerColumnsBlock *block = (const ThermometerColumnsBlock *)(reader->data + offset);
+
+        // the block the recorder was writing when it stopped may be partial, it ends the walk
+        if (!thermometer_columns_block_valid(reader, offset, block))
+            break;
+
+        if (reader->block_count == capacity)
+        {
+            ThermometerColumnsIndex *grown;
+
+            capacity = capacity ? capacity * 2 : 64;
+            grown = (ThermometerColumnsIndex *)realloc(reader->rebuilt_index, capacity * sizeof(*grown));
+            if (grown == NULL)
+                return -1;
+            reader->rebuilt_index = grown;
+        }
+
+        reader->rebuilt_index[reader->block_count].offset = offset;
+        reader->rebuilt_index[reader->block_count].block = *block;
+        reader->block_count++;
+        offset += block->size;
+    }
+
+    reader->index = reader->rebuilt_index;
+
+    return 0;
+}
+
+/// @brief Unmaps a recording
+static inline void thermometer_columns_close(ThermometerColumnsReader *reader)
+{
+    if (reader->data != NULL && reader->size != 0)
+        munmap((void *)reader->data, reader->size);
+
+    free(reader->rebuilt_index);
+    memset(reader, 0, sizeof(*reader));
+}
+
+/// @brief Maps a recording and finds its index
+/// @param[out] reader the reader to set up
+/// @param[in] path the recording
+/// @return 0 on success, -1 with errno set otherwise
+static inline int thermometer_columns_open(ThermometerColumnsReader *reader, const char *path)
+{
+    const ThermometerColumnsFooter *footer;
+    struct stat status;
+    void *mapping;
+    int fd;
+
+    memset(reader, 0, sizeof(*reader));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(ThermometerColumnsHeader))
+    {
+        close(fd);
+        errno = errno ? errno : EPROTO;
+        return -1;
+    }
+
+    mapping = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    reader->data = (const unsigned char *)mapping;
+    reader->size = status.st_size;
+    reader->header = (const ThermometerColumnsHeader *)mapping;
+
+    if (reader->header->magic != THERMOMETER_COLUMNS_MAGIC || reader->header->version != THERMOMETER_COLUMNS_VERSION ||
+        reader->header->header_size < sizeof(ThermometerColumnsHeader) || reader->header->header_size > reader->size)
+    {
+        thermometer_columns_close(reader);
+        errno = EPROTO;
+        return -1;
+    }
+
+    footer = (const ThermometerColumnsFooter *)(reader->data + reader->size - sizeof(*footer));
+    if (reader->size >= reader->header->header_size + sizeof(*footer) &&
+        footer->magic == THERMOMETER_COLUMNS_INDEX_MAGIC && footer->index_offset >= reader->header->header_size &&
+        footer->index_offset + (__u64)footer->block_count * sizeof(ThermometerColumnsIndex) + sizeof(*footer) ==
+            reader->size)
+    {
+        reader->index = (const ThermometerColumnsIndex *)(reader->data + footer->index_offset);
+        reader->block_count = footer->block_count;
+        reader->closed = 1;
+        return 0;
+    }
+
+    if (thermometer_columns_rebuild_index(reader) != 0)
+    {
+        thermometer_columns_close(reader);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/// @brief Finds the first block that holds samples at or after a time
+/// @return the index of the block, block_count if there is none
+static inline __u32 thermometer_columns_find(const ThermometerColumnsReader *reader, __u64 time)
+{
+    __u32 low = 0;
+    __u32 high = reader->block_count;
+
+    while (low < high)
+    {
+        __u32 middle = low + (high - low) / 2;
+
+        if (reader->index[middle].block.last_timestamp < time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+/// @brief Decodes a block
+/// @param[in] reader the recording
+/// @param[in] block the index of the block
+/// @param[out] timestamps room for header->block_samples timestamps
+/// @param[out] values room for header->block_samples values
+/// @return the number of samples decoded, -1 if the block is corrupt
+static inline int thermometer_columns_decode(const ThermometerColumnsReader *reader, __u32 block,
+                                             __u64 *timestamps, __s32 *values)
+{
+    const ThermometerColumnsIndex *entry = &reader->index[block];
+    const unsigned char *in;
+    const unsigned char *end;
+    __u64 value;
+    __u32 i;
+
+    if (block >= reader->block_count || !thermometer_columns_block_valid(reader, entry->offset, &entry->block))
+        return -1;
+
+    in = reader->data + entry->offset + sizeof(ThermometerColumnsBlock);
+    end = in + entry->block.timestamp_bytes;
+    timestamps[0] = entry->block.first_timestamp;
+    for (i = 1; i < entry->block.count; i++)
+    {
+        in = thermometer_columns_get(in, end, &value);
+        if (in == NULL)
+            return -1;
+        timestamps[i] = timestamps[i - 1] + value;
+    }
+
+    end = reader->data + entry->offset + entry->block.size;
+    values[0] = entry->block.first_value;
+    for (i = 1; i < entry->block.count; i++)
+    {
+        in = thermometer_columns_get(in, end, &value);
+        if (in == NULL)
+            return -1;
+        values[i] = (__s32)(values[i - 1] + thermometer_columns_unzigzag(value));
+    }
+
+    return (int)entry->block.count;
+}
+
+/// @brief Summarizes the samples with from <= timestamp < to
+/// @param[in] reader the recording
+/// @param[in] from the start of the range in ns
+/// @param[in] to the end of the range in ns, exclusive
+/// @param[out] aggregate the summary, count is 0 if the range holds no samples
+/// @param[in] timestamps scratch room for header->block_samples timestamps
+/// @param[in] values scratch room for header->block_samples values
+/// @return 0 on success, -1 if a block is corrupt
+static inline int thermometer_columns_aggregate(const ThermometerColumnsReader *reader, __u64 from, __u64 to,
+                                                ThermometerColumnsAggregate *aggregate, __u64 *timestamps,
+                                                __s32 *values)
+{
+    __u32 block;
+
+    memset(aggregate, 0, sizeof(*aggregate));
+
+    for (block = thermometer_columns_find(reader, from); block < reader->block_count; block++)
+    {
+        const ThermometerColumnsBlock *header = &reader->index[block].block;
+        int count;
+        int i;
+
+        if (header->first_timestamp >= to)
+            break;
+
+        if (header->first_timestamp >= from && header->last_timestamp < to)
+        {
+            aggregate->min = aggregate->count == 0 || header->min < aggregate->min ? header->min : aggregate->min;
+            aggregate->max = aggregate->count == 0 || header->max > aggregate->max ? header->max : aggregate->max;
+            aggregate->count += header->count;
+            aggregate->sum += header->sum;
+            continue;
+        }
+
+        count = thermometer_columns_decode(reader, block, timestamps, values);
+        if (count < 0)
+            return -1;
+        aggregate->blocks_decoded++;
+
+        for (i = 0; i < count; i++)
+        {
+            if (timestamps[i] < from || timestamps[i] >= to)
+                continue;
+
+            aggregate->min = aggregate->count == 0 || values[i] < aggregate->min ? values[i] : aggregate->min;
+            aggregate->max = aggregate->count == 0 || values[i] > aggregate->max ? values[i] : aggregate->max;
+            aggregate->count++;
+            aggregate->sum += values[i];
+        }
+    }
+
+    return 0;
+}
+
+#endif // THERMOMETER_COLUMNS_H
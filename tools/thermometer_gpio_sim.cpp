@@ -0,0 +1,282 @@
+/// @file thermometer_gpio_sim.cpp
+/// @brief Host check and benchmark of the driver's BCM2835 register fast path
+///
+/// The thermometer_bcm2835.h accessors are pointed at a simulated register window.  A simulated
+/// peripheral latches GPSET/GPCLR writes into GPLEV like the real block does, and a POSIX timer
+/// raises the input pin after the simulated charge time from a signal handler, interrupting the
+/// poll loop the way the real edge would.  The tool checks the register logic, compares the rate
+/// of the direct poll loop with a gpiolib style indirect read, and reports how long the poll loop
+/// takes to see each simulated edge.
+///
+/// usage: thermometer_gpio_sim [--charges N] [--charge-us N] [--reads N]
+
+#include "../src/thermometer_bcm2835.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+const unsigned int input_pin = 18;
+const unsigned int output_pin = 23;
+const unsigned int polls_per_deadline_check = 1024;   // as in thermometer_charge_spin
+const uint64_t charge_timeout_ns = 1000000000;
+
+/// @brief The simulated register window, written from the signal handler like MMIO from hardware
+volatile uint32_t window[THERMOMETER_BCM2835_GPIO_SIZE / sizeof(uint32_t)];
+volatile uint64_t edge_time;   // monotonic time the simulated edge was raised at
+timer_t edge_timer;
+
+struct Options
+{
+    int charges = 200;
+    int charge_us = 1000;
+    long reads = 50000000;
+};
+
+uint64_t monotonic_ns()
+{
+    timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+volatile uint32_t &reg(unsigned int offset)
+{
+    return window[offset / sizeof(uint32_t)];
+}
+
+void raise_edge(int)
+{
+    edge_time = monotonic_ns();
+    reg(THERMOMETER_BCM2835_GPLEV0) = reg(THERMOMETER_BCM2835_GPLEV0) | (1U << input_pin);
+}
+
+void arm_edge(uint64_t delay_ns)
+{
+    itimerspec expiry = {};
+
+    expiry.it_value.tv_sec = delay_ns / 1000000000ULL;
+    expiry.it_value.tv_nsec = delay_ns % 1000000000ULL;
+    timer_settime(edge_timer, 0, &expiry, nullptr);
+}
+
+/// @brief The simulated peripheral: applies pending GPSET/GPCLR writes to GPLEV and the RC circuit
+void latch(uint64_t charge_ns)
+{
+    uint32_t set = reg(THERMOMETER_BCM2835_GPSET0);
+    uint32_t clear = reg(THERMOMETER_BCM2835_GPCLR0);
+
+    reg(THERMOMETER_BCM2835_GPSET0) = 0;
+    reg(THERMOMETER_BCM2835_GPCLR0) = 0;
+
+    if (clear & (1U << output_pin))
+    {
+        // discharging pulls the input low straight away
+        arm_edge(0);
+        reg(THERMOMETER_BCM2835_GPLEV0) = reg(THERMOMETER_BCM2835_GPLEV0) & ~((1U << output_pin) | (1U << input_pin));
+    }
+
+    if (set & (1U << output_pin))
+    {
+        reg(THERMOMETER_BCM2835_GPLEV0) = reg(THERMOMETER_BCM2835_GPLEV0) | (1U << output_pin);
+        arm_edge(charge_ns);
+    }
+}
+
+bool check(bool condition, const char *what)
+{
+    if (!condition)
+        std::cerr << "logic: " << what << " failed\n";
+
+    return condition;
+}
+
+/// @brief Checks the accessors against the register layout
+bool check_logic()
+{
+    bool ok = true;
+
+    thermometer_bcm2835_set_level(window, output_pin, 1);
+    ok &= check(reg(THERMOMETER_BCM2835_GPSET0) == 1U << output_pin, "set writes GPSET0");
+    latch(charge_timeout_ns);
+    ok &= check(thermometer_bcm2835_get_level(window, output_pin) == 1, "set output reads back high");
+    ok &= check(thermometer_bcm2835_get_level(window, input_pin) == 0, "input stays low while charging");
+    ok &= check(thermometer_bcm2835_wait_high(window, input_pin, 16) == 0, "wait on a low pin gives up");
+
+    thermometer_bcm2835_set_level(window, output_pin, 0);
+    ok &= check(reg(THERMOMETER_BCM2835_GPCLR0) == 1U << output_pin, "clear writes GPCLR0");
+    latch(0);
+    ok &= check(thermometer_bcm2835_get_level(window, output_pin) == 0, "cleared output reads back low");
+
+    reg(THERMOMETER_BCM2835_GPLEV0) = 1U << input_pin;
+    ok &= check(thermometer_bcm2835_wait_high(window, input_pin, 16) == 1, "wait on a high pin returns at once");
+    reg(THERMOMETER_BCM2835_GPLEV0) = 0;
+
+    std::printf("logic:             %s\n", ok ? "ok" : "FAILED");
+
+    return ok;
+}
+
+/// @brief A gpiolib style read: descriptor, chip and a callback per read
+struct FakeChip
+{
+    int (*get)(FakeChip *chip, unsigned int offset);
+    ThermometerBcm2835Regs regs;
+};
+
+struct FakeDesc
+{
+    FakeChip *chip;
+    unsigned int offset;
+};
+
+int fake_chip_get(FakeChip *chip, unsigned int offset)
+{
+    return thermometer_bcm2835_get_level(chip->regs, offset);
+}
+
+__attribute__((noinline)) int fake_gpio_get_value(const FakeDesc *desc)
+{
+    if (desc == nullptr || desc->chip == nullptr)
+        return -1;
+
+    return desc->chip->get(desc->chip, desc->offset) ? 1 : 0;
+}
+
+void measure_loop_rate(long reads)
+{
+    FakeChip chip = {fake_chip_get, window};
+    FakeDesc desc = {&chip, input_pin};
+    long chunks = std::max(1L, reads / polls_per_deadline_check);
+    unsigned long seen = 0;
+
+    reg(THERMOMETER_BCM2835_GPLEV0) = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < chunks; i++)
+        seen += thermometer_bcm2835_wait_high(window, input_pin, polls_per_deadline_check);
+    auto direct = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (long i = 0; i < chunks * polls_per_deadline_check; i++)
+        seen += fake_gpio_get_value(&desc);
+    auto indirect = std::chrono::steady_clock::now() - start;
+
+    double total = static_cast<double>(chunks) * polls_per_deadline_check;
+    std::printf("direct read:       %.2f ns\n", std::chrono::duration<double, std::nano>(direct).count() / total);
+    std::printf("gpiolib style:     %.2f ns\n", std::chrono::duration<double, std::nano>(indirect).count() / total);
+
+    if (seen != 0)
+        std::printf("(the input was seen high %lu times)\n", seen);
+}
+
+bool measure_charges(const Options &options)
+{
+    std::vector<double> latencies;
+    uint64_t charge_ns = static_cast<uint64_t>(options.charge_us) * 1000;
+    double polls = 0.0;
+
+    for (int i = 0; i < options.charges; i++)
+    {
+        unsigned int seen;
+
+        thermometer_bcm2835_set_level(window, output_pin, 0);
+        latch(0);
+
+        // the driver's loop: start, drive the output high, poll in chunks between deadline checks
+        uint64_t start = monotonic_ns();
+        uint64_t deadline = start + charge_timeout_ns;
+        thermometer_bcm2835_set_level(window, output_pin, 1);
+        latch(charge_ns);
+        while ((seen = thermometer_bcm2835_wait_high(window, input_pin, polls_per_deadline_check)) == 0)
+        {
+            polls += polls_per_deadline_check;
+            if (monotonic_ns() > deadline)
+            {
+                std::cerr << "charge " << i << " timed out\n";
+                return false;
+            }
+        }
+        uint64_t end = monotonic_ns();
+
+        polls += seen;
+        latencies.push_back(static_cast<double>(end - edge_time));
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0.0;
+    for (double latency : latencies)
+        sum += latency;
+
+    std::printf("charges:           %d of %d us\n", options.charges, options.charge_us);
+    std::printf("polls per charge:  %.0f\n", polls / options.charges);
+    std::printf("edge to detection: mean %.0f ns, p50 %.0f ns, p99 %.0f ns, max %.0f ns\n",
+                sum / latencies.size(), latencies[latencies.size() / 2],
+                latencies[latencies.size() * 99 / 100], latencies.back());
+
+    return true;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (argument == "--charges" && has_value)
+            options.charges = std::atoi(argv[++i]);
+        else if (argument == "--charge-us" && has_value)
+            options.charge_us = std::atoi(argv[++i]);
+        else if (argument == "--reads" && has_value)
+            options.reads = std::atol(argv[++i]);
+        else
+            return false;
+    }
+
+    return options.charges > 0 && options.charge_us > 0 && options.reads > 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    struct sigaction action = {};
+    sigevent event = {};
+
+    if (!parse_options(argc, argv, options))
+    {
+        std::cerr << "usage: " << argv[0] << " [--charges N] [--charge-us N] [--reads N]\n";
+        return 1;
+    }
+
+    action.sa_handler = raise_edge;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = SIGALRM;
+    if (sigaction(SIGALRM, &action, nullptr) != 0 || timer_create(CLOCK_MONOTONIC, &event, &edge_timer) != 0)
+    {
+        std::perror("Can't set up the edge timer");
+        return 1;
+    }
+
+    if (!check_logic())
+        return 1;
+
+    measure_loop_rate(options.reads);
+
+    return measure_charges(options) ? 0 : 1;
+}
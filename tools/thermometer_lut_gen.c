@@ -0,0 +1,207 @@
+/// @file thermometer_lut_gen.c
+/// @brief Host tool that turns a vendor resistance-temperature CSV into the driver's lookup table
+///
+/// The CSV holds one "temperature_c,resistance_ohm" pair per line, lines that don't start with a
+/// number (headers, comments) are skipped.  The table is resampled every step_mc millidegrees,
+/// interpolating linearly in ln(R) which is close to exact for NTC thermistors, and written as a
+/// header of segments sorted by resistance, each with a precomputed Q16 slope, so that the driver
+/// converts with a binary search and a single multiply.
+///
+/// usage: thermometer_lut_gen input.csv output.h [step_mc]
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_POINTS 4096U
+#define MAX_ENTRIES 4096U
+
+typedef struct RtPoint
+{
+    double temperature;
+    double resistance;
+} RtPoint;
+
+static int compare_temperature(const void *a, const void *b)
+{
+    const RtPoint *left = (const RtPoint *)a;
+    const RtPoint *right = (const RtPoint *)b;
+
+    return (left->temperature > right->temperature) - (left->temperature < right->temperature);
+}
+
+/// @brief Reads the R-T pairs of the CSV
+/// @param[in] path the CSV to read
+/// @param[out] points the points read, sorted by temperature
+/// @return the number of points, -1 on error
+static int read_points(const char *path, RtPoint *points)
+{
+    char line[256];
+    FILE *file;
+    int count = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *cursor = line;
+
+        while (isspace((unsigned char)*cursor))
+            cursor++;
+
+        if (*cursor != '-' && *cursor != '+' && !isdigit((unsigned char)*cursor))
+            continue;
+
+        if (count == MAX_POINTS)
+        {
+            fprintf(stderr, "%s has more than %u points\n", path, MAX_POINTS);
+            fclose(file);
+            return -1;
+        }
+
+        if (sscanf(cursor, "%lf , %lf", &points[count].temperature, &points[count].resistance) != 2 ||
+            points[count].resistance <= 0.0)
+        {
+            fprintf(stderr, "%s: malformed line: %s", path, line);
+            fclose(file);
+            return -1;
+        }
+
+        count++;
+    }
+
+    fclose(file);
+
+    qsort(points, count, sizeof(RtPoint), compare_temperature);
+
+    return count;
+}
+
+/// @brief Interpolates the resistance at a temperature in ln(R)
+static double resistance_at(const RtPoint *points, int count, double temperature)
+{
+    int i;
+
+    for (i = 1; i < count - 1 && points[i].temperature < temperature; i++)
+        ;
+
+    double fraction = (temperature - points[i - 1].temperature) /
+                      (points[i].temperature - points[i - 1].temperature);
+
+    return exp(log(points[i - 1].resistance) +
+               fraction * (log(points[i].resistance) - log(points[i - 1].resistance)));
+}
+
+int main(int argc, char **argv)
+{
+    static RtPoint points[MAX_POINTS];
+    static long resistance[MAX_ENTRIES];
+    static long temperature[MAX_ENTRIES];
+    long step = 1000;
+    int count, entries = 0;
+    int i;
+    FILE *output;
+
+    if (argc < 3 || argc > 4)
+    {
+        fprintf(stderr, "usage: %s input.csv output.h [step_mc]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc == 4)
+        step = strtol(argv[3], NULL, 10);
+
+    if (step <= 0)
+    {
+        fprintf(stderr, "step_mc must be positive\n");
+        return 1;
+    }
+
+    count = read_points(argv[1], points);
+    if (count < 0)
+        return 1;
+
+    if (count < 2)
+    {
+        fprintf(stderr, "%s needs at least 2 points\n", argv[1]);
+        return 1;
+    }
+
+    for (i = 1; i < count; i++)
+    {
+        if (points[i].temperature == points[i - 1].temperature ||
+            points[i].resistance >= points[i - 1].resistance)
+        {
+            fprintf(stderr, "%s must be strictly decreasing in resistance (NTC)\n", argv[1]);
+            return 1;
+        }
+    }
+
+    // resample from the hottest to the coldest point, so that resistance ascends
+    long hottest = (long)floor(points[count - 1].temperature * 1000.0);
+    long coldest = (long)ceil(points[0].temperature * 1000.0);
+    for (long t = hottest; t >= coldest; t -= step)
+    {
+        if (entries == MAX_ENTRIES)
+        {
+            fprintf(stderr, "More than %u entries, use a larger step\n", MAX_ENTRIES);
+            return 1;
+        }
+
+        temperature[entries] = t;
+        resistance[entries] = lround(resistance_at(points, count, t / 1000.0));
+
+        // adjacent entries that round to the same resistance would make a zero width segment
+        if (entries > 0 && resistance[entries] <= resistance[entries - 1])
+            continue;
+
+        entries++;
+    }
+
+    if (entries < 2)
+    {
+        fprintf(stderr, "The table covers less than one step\n");
+        return 1;
+    }
+
+    output = fopen(argv[2], "w");
+    if (output == NULL)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    fprintf(output, "// Generated by tools/thermometer_lut_gen from %s, do not edit\n\n", argv[1]);
+    fprintf(output, "#ifndef THERMOMETER_LUT_H\n#define THERMOMETER_LUT_H\n\n");
+    fprintf(output, "#define THERMOMETER_LUT_ENTRIES %d\n\n", entries);
+    fprintf(output, "/// @brief R-T segments sorted by resistance in ohms, temperatures in millidegrees C and\n");
+    fprintf(output, "/// slopes in millidegrees per ohm in Q16\n");
+    fprintf(output, "static const ThermometerLutEntry thermometer_lut[THERMOMETER_LUT_ENTRIES] = {\n");
+    for (i = 0; i < entries; i++)
+    {
+        long slope = 0;
+
+        if (i + 1 < entries)
+            slope = lround((double)(temperature[i + 1] - temperature[i]) * 65536.0 /
+                           (double)(resistance[i + 1] - resistance[i]));
+
+        fprintf(output, "    {%ld, %ld, %ld},\n", resistance[i], temperature[i], slope);
+    }
+    fprintf(output, "};\n\n#endif // THERMOMETER_LUT_H\n");
+
+    if (fclose(output) != 0)
+    {
+        fprintf(stderr, "Can't write %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,584 @@
+/// @file thermometer_recorder.cpp
+/// @brief Records the sample stream into the columnar format of thermometer_columns.h and reads it back
+///
+/// record reads "timestamp_ns value" lines, as /dev/thermometer_stream returns them, or bare
+/// "value" lines of older text logs, whose timestamps are then spaced --interval-ms apart from
+/// --start-ns. Samples are written a block at a time and the index and footer when the input ends
+/// or the recorder is stopped. A block is also closed early and synced to disk once it has been
+/// open for --flush-s, so a crash loses at most that much; the index of such a file is rebuilt
+/// from its blocks when it is read. Recording into an existing file appends to it.
+///
+/// Samples from the stream node are stored in CLOCK_REALTIME, converted with the offset the driver
+/// publishes in the ring control page of --device, so a recording keeps rising across reboots.
+/// Other inputs keep their timestamps as they are. The file is tagged with the driver's raw_samples
+/// setting, or --raw for other inputs, and recording stops if the setting changes, so charge times
+/// never end up among temperatures. Appending needs the same clock and kind of values as the file.
+///
+/// scan aggregates a time range from the block headers, decoding only the blocks at its ends, and
+/// dump prints the samples of a time range.
+///
+/// usage: thermometer_recorder record file [--input path] [--interval-ms N] [--start-ns N]
+///                                         [--block-samples N] [--flush-s N] [--device path] [--raw]
+///        thermometer_recorder scan file [--from ns] [--to ns]
+///        thermometer_recorder dump file [--from ns] [--to ns]
+
+#include "thermometer_columns.h"
+#include "../src/thermometer_abi.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+volatile sig_atomic_t stopping = 0;
+
+struct Options
+{
+    std::string command;
+    std::string path;
+    std::string input = "/dev/thermometer_stream";
+    uint64_t interval_ms = 1000;
+    uint64_t start_ns = 0;
+    unsigned int block_samples = THERMOMETER_COLUMNS_BLOCK_SAMPLES;
+    unsigned int flush_s = 60;
+    std::string device = "/dev/thermometer";
+    bool raw = false;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+};
+
+void stop(int)
+{
+    stopping = 1;
+}
+
+std::string describe(uint32_t flags)
+{
+    return std::string(flags & THERMOMETER_COLUMNS_REALTIME ? "CLOCK_REALTIME" : "CLOCK_MONOTONIC") +
+           (flags & THERMOMETER_COLUMNS_RAW ? " charge times" : " temperatures");
+}
+
+/// @brief Appends samples to a recording, one block at a time
+class Writer
+{
+public:
+    ~Writer()
+    {
+        if (file_ != nullptr)
+            std::fclose(file_);
+    }
+
+    /// @brief Creates the recording, or reopens it to append after its last complete block
+    bool open(const std::string &path, unsigned int block_samples, uint32_t flags)
+    {
+        ThermometerColumnsReader reader;
+        uint64_t end = 0;
+
+        if (thermometer_columns_open(&reader, path.c_str()) == 0)
+        {
+            if (reader.header->flags != flags)
+            {
+                std::cerr << path << " holds " << describe(reader.header->flags) << ", can't append "
+                          << describe(flags) << "\n";
+                thermometer_columns_close(&reader);
+                return false;
+            }
+
+            // the index is rewritten on close, so the new blocks go where it was
+            block_samples_ = reader.header->block_samples;
+            end = reader.header->header_size;
+            for (uint32_t i = 0; i < reader.block_count; i++)
+            {
+                index_.push_back(reader.index[i]);
+                end = reader.index[i].offset + reader.index[i].block.size;
+            }
+            thermometer_columns_close(&reader);
+
+            file_ = std::fopen(path.c_str(), "r+b");
+            if (file_ == nullptr || truncate(path.c_str(), end) != 0 || std::fseek(file_, end, SEEK_SET) != 0)
+            {
+                std::perror(path.c_str());
+                return false;
+            }
+            std::cerr << "Appending to " << index_.size() << " blocks\n";
+        }
+        else
+        {
+            ThermometerColumnsHeader header = {};
+            timespec now;
+
+            if (errno != ENOENT)
+            {
+                std::perror(path.c_str());
+                return false;
+            }
+
+            clock_gettime(CLOCK_REALTIME, &now);
+            header.magic = THERMOMETER_COLUMNS_MAGIC;
+            header.version = THERMOMETER_COLUMNS_VERSION;
+            header.header_size = sizeof(header);
+            header.block_samples = block_samples;
+            header.flags = flags;
+            header.created = static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+            block_samples_ = block_samples;
+
+            file_ = std::fopen(path.c_str(), "wb");
+            if (file_ == nullptr || std::fwrite(&header, sizeof(header), 1, file_) != 1)
+            {
+                std::perror(path.c_str());
+                return false;
+            }
+            end = sizeof(header);
+        }
+
+        offset_ = end;
+        return true;
+    }
+
+    uint64_t last_timestamp() const
+    {
+        if (!timestamps_.empty())
+            return timestamps_.back();
+
+        return index_.empty() ? 0 : index_.back().block.last_timestamp;
+    }
+
+    bool add(uint64_t timestamp, int32_t value)
+    {
+        timestamps_.push_back(timestamp);
+        values_.push_back(value);
+
+        return timestamps_.size() < block_samples_ || flush();
+    }
+
+    /// @brief Writes the pending samples as a block
+    bool flush()
+    {
+        if (timestamps_.empty())
+            return true;
+
+        ThermometerColumnsIndex entry = {};
+        ThermometerColumnsBlock &block = entry.block;
+        std::vector<unsigned char> encoded(sizeof(block) + timestamps_.size() * 20 + THERMOMETER_COLUMNS_ALIGN);
+        size_t length = sizeof(block);
+
+        block.magic = THERMOMETER_COLUMNS_BLOCK_MAGIC;
+        block.count = static_cast<uint32_t>(timestamps_.size());
+        block.first_timestamp = timestamps_.front();
+        block.last_timestamp = timestamps_.back();
+        block.first_value = block.min = block.max = values_.front();
+
+        for (size_t i = 1; i < timestamps_.size(); i++)
+            length += thermometer_columns_put(&encoded[length], timestamps_[i] - timestamps_[i - 1]);
+        block.timestamp_bytes = static_cast<uint32_t>(length - sizeof(block));
+
+        for (size_t i = 0; i < values_.size(); i++)
+        {
+            if (i != 0)
+            {
+                int64_t delta = static_cast<int64_t>(values_[i]) - values_[i - 1];
+                length += thermometer_columns_put(&encoded[length], thermometer_columns_zigzag(delta));
+            }
+            block.min = std::min(block.min, values_[i]);
+            block.max = std::max(block.max, values_[i]);
+            block.sum += values_[i];
+        }
+
+        block.size = static_cast<uint32_t>(thermometer_columns_align(length));
+        std::copy(reinterpret_cast<const unsigned char *>(&block),
+                  reinterpret_cast<const unsigned char *>(&block) + sizeof(block), encoded.begin());
+
+        if (std::fwrite(encoded.data(), block.size, 1, file_) != 1 || std::fflush(file_) != 0)
+        {
+            std::perror("Can't write a block");
+            return false;
+        }
+
+        entry.offset = offset_;
+        offset_ += block.size;
+        index_.push_back(entry);
+        timestamps_.clear();
+        values_.clear();
+
+        return true;
+    }
+
+    /// @brief Writes the pending samples as a block and waits for them to reach the disk
+    bool sync()
+    {
+        if (!flush())
+            return false;
+
+        if (fsync(fileno(file_)) != 0)
+        {
+            std::perror("Can't sync the recording");
+            return false;
+        }
+
+        return true;
+    }
+
+    /// @brief Whether samples are waiting for the block to fill
+    bool pending() const
+    {
+        return !timestamps_.empty();
+    }
+
+    /// @brief Writes the last block, the index and the footer
+    bool close()
+    {
+        ThermometerColumnsFooter footer = {};
+
+        if (!flush())
+            return false;
+
+        footer.index_offset = offset_;
+        footer.block_count = static_cast<uint32_t>(index_.size());
+        footer.magic = THERMOMETER_COLUMNS_INDEX_MAGIC;
+
+        bool ok = index_.empty() || std::fwrite(index_.data(), sizeof(index_[0]), index_.size(), file_) == index_.size();
+        ok &= std::fwrite(&footer, sizeof(footer), 1, file_) == 1;
+        ok &= std::fclose(file_) == 0;
+        file_ = nullptr;
+
+        if (!ok)
+            std::perror("Can't write the index");
+
+        return ok;
+    }
+
+private:
+    std::FILE *file_ = nullptr;
+    uint64_t offset_ = 0;
+    unsigned int block_samples_ = THERMOMETER_COLUMNS_BLOCK_SAMPLES;
+    std::vector<ThermometerColumnsIndex> index_;
+    std::vector<uint64_t> timestamps_;
+    std::vector<int32_t> values_;
+};
+
+/// @brief Maps sample timestamps to CLOCK_REALTIME with the offset in the driver's ring control page
+class WallClock
+{
+public:
+    ~WallClock()
+    {
+        if (page_ != nullptr)
+            munmap(const_cast<ThermometerRingPage *>(page_), page_size_);
+    }
+
+    bool open(const std::string &device)
+    {
+        int fd = ::open(device.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            std::perror(device.c_str());
+            return false;
+        }
+
+        // the control page can be mapped on its own
+        page_size_ = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        void *mapping = mmap(nullptr, page_size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            std::perror("Can't map the ring's control page");
+            return false;
+        }
+
+        page_ = static_cast<const ThermometerRingPage *>(mapping);
+        if (page_->version != THERMOMETER_RING_VERSION)
+        {
+            std::cerr << device << " has ring version " << page_->version << ", expected "
+                      << THERMOMETER_RING_VERSION << "\n";
+            return false;
+        }
+
+        return true;
+    }
+
+    /// @brief Converts a CLOCK_MONOTONIC timestamp of the driver's
+    uint64_t realtime(uint64_t timestamp) const
+    {
+        __u32 sequence;
+        __s64 offset;
+
+        // offsets_seq is odd while the driver rewrites the offsets
+        do
+        {
+            sequence = __atomic_load_n(&page_->offsets_seq, __ATOMIC_ACQUIRE);
+            offset = __atomic_load_n(&page_->offset_real, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((sequence & 1) != 0 || sequence != __atomic_load_n(&page_->offsets_seq, __ATOMIC_RELAXED));
+
+        return timestamp + static_cast<uint64_t>(offset);
+    }
+
+private:
+    const ThermometerRingPage *page_ = nullptr;
+    size_t page_size_ = 0;
+};
+
+/// @brief Whether the driver streams charge times instead of temperatures
+bool driver_raw()
+{
+    std::ifstream parameter("/sys/module/thermometer/parameters/raw_samples");
+    char value = 'N';
+
+    parameter >> value;
+
+    return value == 'Y';
+}
+
+uint64_t monotonic_ms()
+{
+    timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return static_cast<uint64_t>(now.tv_sec) * 1000ULL + static_cast<uint64_t>(now.tv_nsec) / 1000000ULL;
+}
+
+int record(const Options &options)
+{
+    Writer writer;
+    std::ifstream file;
+    std::istream *input = &std::cin;
+    std::string line;
+    uint64_t samples = 0;
+    uint64_t skipped = 0;
+    WallClock wall_clock;
+    struct stat status;
+    bool live = options.input != "-" && stat(options.input.c_str(), &status) == 0 && S_ISCHR(status.st_mode);
+    bool raw = live ? driver_raw() : options.raw;
+    int result = 0;
+
+    if (live && !wall_clock.open(options.device))
+        return 1;
+
+    if (options.input != "-")
+    {
+        file.open(options.input);
+        if (!file)
+        {
+            std::cerr << "Can't open " << options.input << "\n";
+            return 1;
+        }
+        input = &file;
+    }
+
+    if (!writer.open(options.path, options.block_samples,
+                     (live ? THERMOMETER_COLUMNS_REALTIME : 0U) | (raw ? THERMOMETER_COLUMNS_RAW : 0U)))
+        return 1;
+
+    uint64_t synthetic = options.start_ns;
+    uint64_t block_opened = 0;
+
+    while (!stopping && std::getline(*input, line))
+    {
+        std::istringstream fields(line);
+        long long first;
+        long long second;
+        uint64_t timestamp;
+        int32_t value;
+
+        if (!(fields >> first))
+        {
+            skipped++;
+            continue;
+        }
+
+        if (fields >> second)
+        {
+            timestamp = live ? wall_clock.realtime(static_cast<uint64_t>(first)) : static_cast<uint64_t>(first);
+            value = static_cast<int32_t>(second);
+        }
+        else
+        {
+            timestamp = synthetic;
+            value = static_cast<int32_t>(first);
+            synthetic += options.interval_ms * 1000000ULL;
+        }
+
+        // the stream lines don't say which kind they are, so the recording ends where it changes
+        if (live && driver_raw() != raw)
+        {
+            std::cerr << "raw_samples changed, record the rest into another file\n";
+            result = 1;
+            break;
+        }
+
+        // the index is searched by time, so samples out of order are dropped
+        if (timestamp < writer.last_timestamp())
+        {
+            skipped++;
+            continue;
+        }
+
+        if (!writer.pending())
+            block_opened = monotonic_ms();
+
+        if (!writer.add(timestamp, value))
+            return 1;
+        samples++;
+
+        // checked as samples come in, a block only waits longer while the input is silent
+        if (options.flush_s != 0 && writer.pending() &&
+            monotonic_ms() - block_opened >= options.flush_s * 1000ULL && !writer.sync())
+            return 1;
+    }
+
+    if (!writer.close())
+        return 1;
+
+    std::cerr << "Recorded " << samples << " samples";
+    if (skipped != 0)
+        std::cerr << ", skipped " << skipped << " lines";
+    std::cerr << "\n";
+
+    return result;
+}
+
+int scan(const Options &options, bool dump)
+{
+    ThermometerColumnsReader reader;
+
+    if (thermometer_columns_open(&reader, options.path.c_str()) != 0)
+    {
+        std::perror(options.path.c_str());
+        return 1;
+    }
+
+    std::vector<__u64> timestamps(reader.header->block_samples);
+    std::vector<__s32> values(reader.header->block_samples);
+    int result = 0;
+
+    if (!reader.closed)
+        std::cerr << options.path << " wasn't closed, its index was rebuilt from " << reader.block_count << " blocks\n";
+
+    if (dump)
+    {
+        for (uint32_t block = thermometer_columns_find(&reader, options.from); block < reader.block_count; block++)
+        {
+            if (reader.index[block].block.first_timestamp >= options.to)
+                break;
+
+            int count = thermometer_columns_decode(&reader, block, timestamps.data(), values.data());
+            if (count < 0)
+            {
+                std::cerr << "Block " << block << " is corrupt\n";
+                result = 1;
+                break;
+            }
+
+            for (int i = 0; i < count; i++)
+            {
+                if (timestamps[i] >= options.from && timestamps[i] < options.to)
+                    std::printf("%llu %d\n", static_cast<unsigned long long>(timestamps[i]), values[i]);
+            }
+        }
+    }
+    else
+    {
+        ThermometerColumnsAggregate aggregate;
+
+        if (thermometer_columns_aggregate(&reader, options.from, options.to, &aggregate, timestamps.data(),
+                                          values.data()) != 0)
+        {
+            std::cerr << "A block in the range is corrupt\n";
+            result = 1;
+        }
+        else
+        {
+            std::printf("kind:     %s\n", describe(reader.header->flags).c_str());
+            std::printf("samples:  %llu\n", static_cast<unsigned long long>(aggregate.count));
+            if (aggregate.count != 0)
+            {
+                std::printf("min:      %d\n", aggregate.min);
+                std::printf("max:      %d\n", aggregate.max);
+                std::printf("mean:     %.3f\n", static_cast<double>(aggregate.sum) / aggregate.count);
+            }
+            std::printf("blocks:   %u decoded of %u\n", aggregate.blocks_decoded, reader.block_count);
+        }
+    }
+
+    thermometer_columns_close(&reader);
+
+    return result;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+    if (argc < 3)
+        return false;
+
+    options.command = argv[1];
+    options.path = argv[2];
+
+    for (int i = 3; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (argument == "--input" && has_value)
+            options.input = argv[++i];
+        else if (argument == "--interval-ms" && has_value)
+            options.interval_ms = std::strtoull(argv[++i], nullptr, 10);
+        else if (argument == "--start-ns" && has_value)
+            options.start_ns = std::strtoull(argv[++i], nullptr, 10);
+        else if (argument == "--block-samples" && has_value)
+            options.block_samples = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
+        else if (argument == "--flush-s" && has_value)
+            options.flush_s = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
+        else if (argument == "--device" && has_value)
+            options.device = argv[++i];
+        else if (argument == "--raw")
+            options.raw = true;
+        else if (argument == "--from" && has_value)
+            options.from = std::strtoull(argv[++i], nullptr, 10);
+        else if (argument == "--to" && has_value)
+            options.to = std::strtoull(argv[++i], nullptr, 10);
+        else
+            return false;
+    }
+
+    return (options.command == "record" || options.command == "scan" || options.command == "dump") &&
+           options.block_samples != 0 && options.from <= options.to;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    struct sigaction action = {};
+
+    if (!parse_options(argc, argv, options))
+    {
+        std::cerr << "usage: " << argv[0] << " record file [--input path] [--interval-ms N] [--start-ns N]"
+                  << " [--block-samples N] [--flush-s N] [--device path] [--raw]\n"
+                  << "       " << argv[0] << " scan file [--from ns] [--to ns]\n"
+                  << "       " << argv[0] << " dump file [--from ns] [--to ns]\n";
+        return 1;
+    }
+
+    // no SA_RESTART, so that a read blocked on the stream node returns to close the recording
+    action.sa_handler = stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    if (options.command == "record")
+        return record(options);
+
+    return scan(options, options.command == "dump");
+}